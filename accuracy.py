@@ -0,0 +1,24 @@
+#!/bin/env python
+
+import sys
+import os
+import numpy as np
+
+
+fields = ('ux', 'uy', 'rho', 'curl')
+
+reference = np.fromfile(sys.argv[1], dtype=np.float64).reshape(len(fields), -1)
+
+
+print('%-24s %-6s %14s %14s %14s' % ('build', 'field', 'max abs', 'rms', 'max rel'))
+
+for path in sys.argv[2:]:
+
+    data = np.fromfile(path, dtype=np.float64).reshape(len(fields), -1)
+
+    for i, name in enumerate(fields):
+
+        diff = np.abs(data[i] - reference[i])
+        scale = np.max(np.abs(reference[i]))
+
+        print('%-24s %-6s %14.6e %14.6e %14.6e' % (os.path.basename(path), name, np.max(diff), np.sqrt(np.mean(diff ** 2)), np.max(diff) / scale if scale > 0 else 0))
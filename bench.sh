@@ -4,111 +4,65 @@
 run_wind() {
 
 
-    export NPROCS=1
-
-
     make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=100" run
+    make -s CXXFLAGS="-DBENCH" headless
 
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r1=$(cat /tmp/bench-output)
 
+    results=""
 
-    make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=1000" run
+    for NPROCS in 1 2 4 8; do
 
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r2=$(cat /tmp/bench-output)
-
-
-    make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=10000" run
-
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r3=$(cat /tmp/bench-output)
+        for STEPS in 100 1000 10000; do
 
+            mpirun -np $NPROCS --oversubscribe ./$1 --steps $STEPS &> /tmp/bench-output
+            results="$results $(cat /tmp/bench-output)"
 
+        done
 
+    done
 
-    export NPROCS=2
 
+    ./graph.py 100 1000 10000 $results
 
-    make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=100" run
-
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r4=$(cat /tmp/bench-output)
-
-
-    make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=1000" run
-
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r5=$(cat /tmp/bench-output)
-
-
-    make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=10000" run
-
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r6=$(cat /tmp/bench-output)
-
-
-
-
-    export NPROCS=4
-
+}
 
-    make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=100" run
 
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r7=$(cat /tmp/bench-output)
+run_precision() {
 
 
-    make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=1000" run
-
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r8=$(cat /tmp/bench-output)
+    export NPROCS=1
 
 
     make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=10000" run
+    make -s CXXFLAGS="-DBENCH -DBENCH_DUMP -DPRECISION=0" headless
 
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r9=$(cat /tmp/bench-output)
-
-
-
-
-    export NPROCS=8
+    mpirun -np $NPROCS --oversubscribe ./$1 --steps 1000 &> /tmp/bench-output
+    mv /tmp/bench-dump /tmp/bench-dump-double
+    r1=$(cat /tmp/bench-output)
 
 
     make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=100" run
+    make -s CXXFLAGS="-DBENCH -DBENCH_DUMP -DPRECISION=1" headless
 
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r10=$(cat /tmp/bench-output)
+    mpirun -np $NPROCS --oversubscribe ./$1 --steps 1000 &> /tmp/bench-output
+    mv /tmp/bench-dump /tmp/bench-dump-float
+    r2=$(cat /tmp/bench-output)
 
 
     make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=1000" run
-
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r11=$(cat /tmp/bench-output)
-
+    make -s CXXFLAGS="-DBENCH -DBENCH_DUMP -DPRECISION=2" headless
 
-    make -s clean
-    make -s CXXFLAGS="-DBENCH -DITERATIONS=10000" run
+    mpirun -np $NPROCS --oversubscribe ./$1 --steps 1000 &> /tmp/bench-output
+    mv /tmp/bench-dump /tmp/bench-dump-mixed
+    r3=$(cat /tmp/bench-output)
 
-    mpirun -np $NPROCS --oversubscribe $1 &> /tmp/bench-output
-    r12=$(cat /tmp/bench-output)
 
+    echo "double: $r1, float: $r2, mixed: $r3"
 
-    ./graph.py 100 1000 10000 $r1 $r2 $r3 $r4 $r5 $r6 $r7 $r8 $r9 $r10 $r11 $r12
+    ./accuracy.py /tmp/bench-dump-double /tmp/bench-dump-float /tmp/bench-dump-mixed
 
 }
 
 
-run_wind apsd
\ No newline at end of file
+run_wind apsd-headless
+run_precision apsd-headless
@@ -24,6 +24,11 @@
 
 
 
+#if defined(BENCH) && !defined(HEADLESS)
+#define HEADLESS
+#endif
+
+
 #include <iostream>
 #include <vector>
 #include <algorithm>
@@ -31,10 +36,29 @@
 #include <sstream>
 #include <cmath>
 #include <cassert>
-
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fstream>
+#include <limits>
+#include <utility>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+
+#if !defined(HEADLESS)
 #include <allegro5/allegro.h>
 #include <allegro5/allegro_font.h>
 #include <allegro5/allegro_primitives.h>
+#endif
 
 #include <mpi.h>
 
@@ -58,52 +82,172 @@
 #define WIND_VISCOSITY              1.40
 
 
+#define ENGINE_INPLACE              0
+#define ENGINE_AB                   1
+#define ENGINE_AA                   2
+#define ENGINE_TILED                3
+
+#if !defined(ENGINE)
+#define ENGINE                      ENGINE_INPLACE
+#endif
+
+
+#if !defined(TILE_WIDTH)
+#define TILE_WIDTH                  64
+#endif
+
+#if !defined(TILE_DEPTH)
+#define TILE_DEPTH                  4
+#endif
+
+
+#if !defined(GRID_COLUMNS)
+#define GRID_COLUMNS                0
+#endif
+
+
+#define SIMD_NONE                   0
+#define SIMD_AVX2                   1
+#define SIMD_AVX512                 2
+
+#if !defined(SIMD)
+#define SIMD                        SIMD_AVX512
+#endif
+
+
+#define PINNING_NONE                0
+#define PINNING_COMPACT             1
+#define PINNING_SCATTER             2
+
+#if !defined(PINNING)
+#define PINNING                     PINNING_NONE
+#endif
+
+#if !defined(THREADS)
+#define THREADS                     1
+#endif
+
+#if !defined(RENDER_THREADS)
+#define RENDER_THREADS              2
+#endif
+
+#if !defined(CONTROL_INTERVAL)
+#define CONTROL_INTERVAL            16
+#endif
+
+#if !defined(BALANCE_INTERVAL)
+#define BALANCE_INTERVAL            512
+#endif
+
+#if !defined(BALANCE_THRESHOLD)
+#define BALANCE_THRESHOLD           0.10
+#endif
+
+
+#define PRECISION_DOUBLE            0
+#define PRECISION_FLOAT             1
+#define PRECISION_MIXED             2
+
+#if !defined(PRECISION)
+#define PRECISION                   PRECISION_DOUBLE
+#endif
+
+
+#if defined(BENCH_DUMP) && !defined(BENCH_DUMP_FILE)
+#define BENCH_DUMP_FILE             "/tmp/bench-dump"
+#endif
+
+
+#if !defined(ITERATIONS)
+#define ITERATIONS                  1000
+#endif
+
+#if !defined(OUTPUT_PREFIX)
+#define OUTPUT_PREFIX               "wind"
+#endif
+
+
 #define XY(x, y, w)     \
     (((y) * (w)) + (x))
 
 
 
 
+#if PRECISION == PRECISION_FLOAT
+
+typedef float  real;
+typedef float  accum;
+
+#elif PRECISION == PRECISION_MIXED
+
+typedef float  real;
+typedef double accum;
+
+#else
+
+typedef double real;
+typedef double accum;
+
+#endif
+
+
+
+template<typename T>
+struct mpi_scalar;
+
+template<>
+struct mpi_scalar<float> {
+    static MPI_Datatype type() { return MPI_FLOAT; }
+};
+
+template<>
+struct mpi_scalar<double> {
+    static MPI_Datatype type() { return MPI_DOUBLE; }
+};
+
+
+
 
-class v2d {
+template<typename T>
+class basic_v2d {
 
     public:
 
-        v2d()
-            : pX(0.0), pY(0.0) { } 
+        constexpr basic_v2d()
+            : pX(0), pY(0) { } 
 
-        v2d(double xy)
+        constexpr basic_v2d(T xy)
             : pX(xy), pY(xy) { }
 
-        v2d(double x, double y)
+        constexpr basic_v2d(T x, T y)
             : pX(x), pY(y) { }
 
 
 
 
-        const double& x() const { return pX; }
-        const double& y() const { return pY; }
+        const T& x() const { return pX; }
+        const T& y() const { return pY; }
 
-        double& x() { return pX; }
-        double& y() { return pY; }
+        T& x() { return pX; }
+        T& y() { return pY; }
 
 
 
 
-        double len() const {
+        T len() const {
             return sqrt(pX * pX + pY * pY);
         }
 
-        double len2() const {
-            return len() * len();
+        T len2() const {
+            return pX * pX + pY * pY;
         }
 
 
-        static double dot(const v2d& v1, const v2d& v2) {
+        static T dot(const basic_v2d& v1, const basic_v2d& v2) {
             return (v1.x() * v2.x()) + (v1.y() * v2.y());
         }
 
-        static double dot2(const v2d& v1, const v2d& v2) {
+        static T dot2(const basic_v2d& v1, const basic_v2d& v2) {
             return dot(v1, v2) * dot(v1, v2);
         }
 
@@ -111,1295 +255,5913 @@ class v2d {
 
     private:
 
-        double pX;
-        double pY;
+        T pX;
+        T pY;
 
 };
 
 
+typedef basic_v2d<accum> v2d;
 
 
 
 
-constexpr double wZero = 4.0 / 9.0;
-constexpr double wCard = 1.0 / 9.0;
-constexpr double wDiag = 1.0 / 36.0;
 
 
-const double W[] = {
-    wZero,
-    wCard,
-    wCard,
-    wCard,
-    wCard,
-    wDiag,
-    wDiag,
-    wDiag,
-    wDiag
-};
+template<int D, int Q>
+struct descriptor;
 
-const v2d E[] = {
-    {  0,  0 },
-    {  1,  0 },
-    {  0,  1 },
-    { -1,  0 },
-    {  0, -1 },
-    {  1,  1 },
-    { -1,  1 },
-    { -1, -1 },
-    {  1, -1 },
-};
 
+template<>
+struct descriptor<2, 9> {
 
+    static constexpr int d = 2;
+    static constexpr int q = 9;
 
+    static constexpr int e[q][d] = {
+        {  0,  0 },
+        {  1,  0 },
+        {  0,  1 },
+        { -1,  0 },
+        {  0, -1 },
+        {  1,  1 },
+        { -1,  1 },
+        { -1, -1 },
+        {  1, -1 },
+    };
 
-struct unit {
+    static constexpr int opposite[q] = {
+        0, 3, 4, 1, 2, 7, 8, 5, 6
+    };
 
+    static constexpr double w[q] = {
+        4.0 / 9.0,
+        1.0 / 9.0,
+        1.0 / 9.0,
+        1.0 / 9.0,
+        1.0 / 9.0,
+        1.0 / 36.0,
+        1.0 / 36.0,
+        1.0 / 36.0,
+        1.0 / 36.0,
+    };
 
-    union {
-        
-        struct {
-            double n0;
-            double nE;
-            double nN;
-            double nW;
-            double nS;
-            double nNE;
-            double nNW;
-            double nSW;
-            double nSE;
-        };
+};
 
-        double n[9];
 
-    };
+typedef descriptor<2, 9> D2Q9;
+typedef D2Q9 model;
 
 
-    bool barrier;
 
-    v2d u;
-    double rho;
-    double curl;
 
+template<int... I, typename F>
+static inline __attribute__((always_inline)) void unroll(std::integer_sequence<int, I...>, F&& f) {
+    (f(std::integral_constant<int, I>()), ...);
+}
 
+template<int N, typename F>
+static inline __attribute__((always_inline)) void unroll(F&& f) {
+    unroll(std::make_integer_sequence<int, N>(), f);
+}
 
-    void zero() {
 
-        for(auto i = 0; i < 9; i++)
-            n[i] = 0.0;
 
-        rho = 0.0;
-        curl = 0.0;
+template<int i>
+struct velocity {
+    static constexpr int at(int a) { return model::e[i][a]; }
+};
 
-    }
+template<int a>
+struct component {
+    static constexpr int at(int i) { return model::e[i][a]; }
+};
 
-    void eq(const double w, const double rho) {
 
-        this->rho = rho;    
-   
-        for(auto i = 0; i < 9; i++)
-            n[i] += w * (rho * W[i] * (1 + 3 * v2d::dot(E[i], u) + 4.5 * v2d::dot2(E[i], u) - 1.5 * u.len2()) - n[i]); 
-        
-    }
+/**
+ * Sum of C::at(j) * v[j] with the zero terms folded away: positive terms
+ * first, then negative ones, both in index order. Coefficients are lattice
+ * velocity components, so only -1, 0 and 1 are expected.
+ */
+template<typename C, int N, int j = 0, bool started = false, typename V>
+static inline __attribute__((always_inline)) void combine(V& sum, const V (&v)[N]) {
 
+    if constexpr (j == 2 * N) {
 
+        if constexpr (!started)
+            sum = V();
 
-    const double new_rho() const {
+    } else {
 
-        return n[0] + n[1] + n[2]
-             + n[3] + n[4] + n[5]
-             + n[6] + n[7] + n[8];
+        constexpr int c = C::at(j % N);
+        constexpr bool negative = j >= N;
 
-    }
+        if constexpr (negative ? c >= 0 : c <= 0) {
 
+            combine<C, N, j + 1, started>(sum, v);
 
-};
+        } else {
 
+            if constexpr (!started)
+                sum = negative ? -v[j % N] : v[j % N];
+            else
+                sum = negative ? sum - v[j % N] : sum + v[j % N];
 
+            combine<C, N, j + 1, true>(sum, v);
 
+        }
 
+    }
 
+}
 
 
-static ALLEGRO_EVENT_QUEUE* queue;
-static ALLEGRO_DISPLAY* disp;
-static ALLEGRO_TIMER* timer;
-static ALLEGRO_FONT* font;
+static inline v2d direction(int i) {
+    return v2d(model::e[i][0], model::e[i][1]);
+}
 
 
-static MPI_Comm MPI_COMM_LOCAL;
-static MPI_Win MPI_LOCAL_WINDOW;
-static MPI_Datatype MPI_TYPE_V2D;
-static MPI_Datatype MPI_TYPE_UNIT;
 
 
-static int world_rank;
-static int world_num_procs;
+template<typename V>
+static inline __attribute__((always_inline)) void moments(const V (&f)[model::q], V& rho, V (&u)[model::d]) {
 
-static int local_rank;
-static int local_num_procs;
 
+    rho = f[0];
 
-static unit* up_units       = nullptr;
-static unit* bottom_units   = nullptr;
-static unit* units          = nullptr;
-static unit* frame          = nullptr;
-static unit* current_unit   = nullptr;
+    unroll<model::q - 1>([&] (auto i) {
+        rho += f[i + 1];
+    });
 
-static uint16_t current_unit_x = 0;
-static uint16_t current_unit_y = 0;
 
+    const auto valid = rho > V();
 
+    unroll<model::d>([&] (auto a) {
 
+        V m;
+        combine<component<a>>(m, f);
 
-static v2d flow_speed = v2d(WIND_SPEED, 0.0);
-static double flow_viscosity = WIND_VISCOSITY;
+        u[a] = valid ? m / rho : V();
 
-static bool running = true;
-static bool resetting = true;
-static bool paused = false;
-static bool draw_groups = false;
-static bool draw_nodes = false;
-static uint8_t draw_mode = 0;
+    });
 
+}
 
 
+template<typename V, typename T>
+static inline __attribute__((always_inline)) void relax(V (&f)[model::q], const V (&u)[model::d], const T w, const V& rho) {
 
 
+    V usq = u[0] * u[0];
 
+    unroll<model::d - 1>([&] (auto a) {
+        usq += u[a + 1] * u[a + 1];
+    });
 
-void HSVtoRGB(int H, double S, double V, int output[3]) {
+    usq = T(1.5) * usq;
 
 
-    double C = S * V;
-    double X = C * (1 - abs(fmod(H / 60.0, 2) - 1));
-    double m = V - C;
-    double Rs, Gs, Bs;
+    unroll<model::q>([&] (auto i) {
 
+        V eu;
+        combine<velocity<i>>(eu, u);
 
-    if(H >= 0 && H < 60) {
-        Rs = C;
-        Gs = X;
-        Bs = 0;	
-    }
+        f[i] += w * (rho * T(model::w[i]) * (T(1) + T(3) * eu + T(4.5) * eu * eu - usq) - f[i]);
 
-    else if(H >= 60 && H < 120) {	
-        Rs = X;
-        Gs = C;
-        Bs = 0;	
-    }
+    });
 
-    else if(H >= 120 && H < 180) {
-        Rs = 0;
-        Gs = C;
-        Bs = X;	
-    }
+}
 
-    else if(H >= 180 && H < 240) {
-        Rs = 0;
-        Gs = X;
-        Bs = C;	
-    }
 
-    else if(H >= 240 && H < 300) {
-        Rs = X;
-        Gs = 0;
-        Bs = C;	
-    }
+static inline void relax(accum (&f)[model::q], const v2d& u, const accum w, const accum rho) {
 
-    else {
-        Rs = C;
-        Gs = 0;
-        Bs = X;	
-    }
-    
-    output[0] = (Rs + m) * 255;
-    output[1] = (Gs + m) * 255;
-    output[2] = (Bs + m) * 255;
+    const accum v[] = { u.x(), u.y() };
 
+    relax(f, v, w, rho);
 
 }
 
 
 
-void reset() {
-    resetting = true;
-}
 
+template<typename T, int N>
+struct vec {
 
-void clear() {
+    typedef T       d __attribute__((vector_size(N * sizeof(T))));
+    typedef T       u __attribute__((vector_size(N * sizeof(T)), aligned(sizeof(T))));
 
-    for(auto x = 0; x < VIEWPORT_WIDTH; x++) {
-        for(auto y = 0; y < VIEWPORT_HEIGHT; y++) {
+    typedef decltype(d() < d()) m;
 
-            frame[XY(x, y, VIEWPORT_WIDTH)].barrier = false;
-            frame[XY(x, y, VIEWPORT_WIDTH)].zero();
+};
 
-        }
-    }
 
-    reset();
+template<typename V, typename S>
+static inline __attribute__((always_inline)) void load(V& v, const S* p) {
 
-}
+    typedef typename vec<S, sizeof(V) / sizeof(v[0])>::u u;
 
+    v = __builtin_convertvector(*reinterpret_cast<const u*>(p), V);
 
-void setDirection(double x, double y) {
+}
 
-    flow_speed.x() = WIND_SPEED * x;
-    flow_speed.y() = WIND_SPEED * y;
+template<typename V, typename S>
+static inline __attribute__((always_inline)) void store(S* p, const V& v) {
 
-    reset();
+    typedef typename vec<S, sizeof(V) / sizeof(v[0])>::d d;
+
+    *reinterpret_cast<typename vec<S, sizeof(V) / sizeof(v[0])>::u*>(p) = __builtin_convertvector(v, d);
 
 }
 
+template<typename V>
+static inline __attribute__((always_inline)) void load(V& v, const bool* p) {
 
-void setBarrier(int x, int y) {
+    typedef int8_t b __attribute__((vector_size(sizeof(V) / sizeof(v[0]))));
 
-    if(x <= 0 || y <= 0 || x >= VIEWPORT_WIDTH - 1 || y >= VIEWPORT_HEIGHT - 1)
-        return;
+    b m;
+    memcpy(&m, p, sizeof(m));
 
-    if(frame[XY(x, y, VIEWPORT_WIDTH)].barrier)
-        return;
+    v = __builtin_convertvector(m, V) != 0;
 
+}
 
-    frame[XY(x, y, VIEWPORT_WIDTH)].barrier = true;
-    frame[XY(x, y, VIEWPORT_WIDTH)].rho = 0.0;
-    frame[XY(x, y, VIEWPORT_WIDTH)].u = v2d();
-    frame[XY(x, y, VIEWPORT_WIDTH)].zero();
 
-    reset();
 
-}
+#define LATTICE_FIELDS              (model::q + 4)
+#define LATTICE_ALIGNMENT           64
 
 
-void setCurrentUnit(int x, int y) {
 
-    if(x < 0 || y < 0 || x > VIEWPORT_WIDTH - 1 || y > VIEWPORT_HEIGHT - 1)
-        return;
+template<typename T>
+struct basic_lattice {
 
-    if(frame[XY(x, y, VIEWPORT_WIDTH)].barrier)
-        return;
 
-    current_unit = &frame[XY(x, y, VIEWPORT_WIDTH)];
-    current_unit_x = x;
-    current_unit_x = y;
+    T* n[model::q];
 
-}
+    T* ux;
+    T* uy;
+    T* rho;
+    T* curl;
 
+    bool* barrier;
 
 
-void redraw(ALLEGRO_EVENT* e) {
+    size_t width;
+    size_t height;
+    size_t size;
+    size_t stride;
 
 
-    al_clear_to_color(al_map_rgb(0, 0, 0));
 
+    static size_t pitch(size_t size) {
 
-    for(auto x = 0; x < VIEWPORT_WIDTH; x++) {
-        for(auto y = 0; y < VIEWPORT_HEIGHT; y++) {
+        constexpr size_t align = LATTICE_ALIGNMENT / sizeof(T);
 
+        return (size + align - 1) & ~(align - 1);
 
-            auto& i = frame[XY(x, y, VIEWPORT_WIDTH)];
+    }
 
-            const double dx = x * VIEWPORT_BLOCKSIZE;
-            const double dy = y * VIEWPORT_BLOCKSIZE;
-            const double dw = x * VIEWPORT_BLOCKSIZE + VIEWPORT_BLOCKSIZE;
-            const double dh = y * VIEWPORT_BLOCKSIZE + VIEWPORT_BLOCKSIZE;
+    static size_t bytes(size_t width, size_t height) {
 
+        const size_t b = pitch(width * height) * (LATTICE_FIELDS * sizeof(T) + sizeof(bool));
 
-            if(i.barrier) {
+        return (b + LATTICE_ALIGNMENT - 1) & ~(LATTICE_ALIGNMENT - 1);
 
-                al_draw_filled_rectangle(dx, dy, dw, dh, al_map_rgb(0, 0, 0));
+    }
 
 
-            } else {
+    void bind(void* data, size_t width, size_t height) {
 
+        this->width  = width;
+        this->height = height;
+        this->size   = width * height;
+        this->stride = pitch(size);
 
-                double value = 0.0;
+        T* p = (T*) data;
 
-                switch(draw_mode) {
+        for(auto i = 0; i < model::q; i++)
+            n[i] = &p[i * stride];
 
-                    case 0: {
-                        
-                            value = i.curl;
+        ux      = &p[(model::q + 0) * stride];
+        uy      = &p[(model::q + 1) * stride];
+        rho     = &p[(model::q + 2) * stride];
+        curl    = &p[(model::q + 3) * stride];
+        barrier = (bool*) &p[LATTICE_FIELDS * stride];
 
+    }
 
-                            constexpr int steps = 8;
-                            constexpr int averg = 3;
 
-                            if(y > steps && y < VIEWPORT_HEIGHT - steps) {
+    void copy(size_t k, const basic_lattice& src, size_t sk, size_t count) {
 
-                                if(((y + averg) % (VIEWPORT_HEIGHT / world_num_procs)) < (averg << 1)) {
+        for(auto i = 0; i < LATTICE_FIELDS; i++)
+            memcpy(&n[0][i * stride + k], &src.n[0][i * src.stride + sk], count * sizeof(T));
 
-                                    for(auto n = 0; n < (steps >> 1); n++)
-                                        value += frame[XY(x, y - n, VIEWPORT_WIDTH)].curl;
+    }
 
-                                    for(auto n = 0; n < (steps >> 1); n++)
-                                        value += frame[XY(x, y + n, VIEWPORT_WIDTH)].curl;
 
-                                    value /= steps;
 
-                                }
+    void zero(size_t k) {
 
+        for(auto i = 0; i < model::q; i++)
+            n[i][k] = 0.0;
 
-                            }
+        rho[k] = 0.0;
+        curl[k] = 0.0;
 
+    }
 
-                        } break;
+    void eq(size_t k, const accum w, const accum rho) {
 
-                    case 1:
-                        value = i.new_rho() / 16.0;
-                        break;
+        accum f[model::q];
 
-                    case 2:
-                        value = i.u.len();
-                        break;
+        for(auto i = 0; i < model::q; i++)
+            f[i] = n[i][k];
 
-                    case 3:
-                        value = i.u.x();
-                        break;
+        relax(f, velocity(k), w, rho);
 
-                    case 4:
-                        value = i.u.y();
-                        break;
+        for(auto i = 0; i < model::q; i++)
+            n[i][k] = f[i];
 
-                }
+        this->rho[k] = rho;
+        
+    }
 
 
 
-            
+    const accum new_rho(size_t k) const {
 
-                int c = 1024 * (value * 4 + 0.5);
+        accum rho = n[0][k];
 
-                if(c > 1024)
-                    c = 1024;
+        for(auto i = 1; i < model::q; i++)
+            rho += n[i][k];
 
-                if(c < 0)
-                    c = 0;
+        return rho;
 
+    }
 
-                int out[3];
-                HSVtoRGB((c / 1024.0) * (2.0 / 3.0) * 360.0 + 90, 0.75, 1, out);
+    const v2d velocity(size_t k) const {
+        return v2d(ux[k], uy[k]);
+    }
 
 
+};
 
-                char r, g, b;
 
-                r = out[0];
-                g = out[1];
-                b = out[2];
-            
-                al_draw_filled_rectangle(dx, dy, dw, dh, al_map_rgb(r, g, b));
+typedef basic_lattice<real> lattice;
 
 
-            }
-                
 
-        }
-    }
+static void* lattice_alloc(lattice& l, size_t width, size_t height) {
 
+    void* data = aligned_alloc(LATTICE_ALIGNMENT, lattice::bytes(width, height));
 
+    if(data) {
 
-    if(draw_groups) {
+        memset(data, 0, lattice::bytes(width, height));
+        l.bind(data, width, height);
 
+    }
 
-        static double group_colors[8][3] = {
-            { 1.0, 0.2, 0.2 },
-            { 0.2, 1.0, 0.2 },
-            { 0.2, 0.2, 1.0 },
-            { 0.5, 0.5, 0.5 },
-            { 0.8, 0.2, 0.6 },
-            { 0.6, 0.8, 0.2 },
-            { 0.2, 0.8, 0.6 },
-            { 0.8, 0.8, 0.6 },
-        };
+    return data;
 
+}
 
-        const double n = world_num_procs / local_num_procs;
-        const double h = VIEWPORT_HEIGHT / (world_num_procs / local_num_procs);
 
-        for(auto i = 0; i < n; i++) {
 
-            const double dx = 10;
-            const double dw = WINDOW_WIDTH - 10;
-            const double dy = (i * h) * VIEWPORT_BLOCKSIZE;
-            const double dh = (dy + (h * VIEWPORT_BLOCKSIZE));
 
-            std::stringstream ss;
-            ss << i;
 
-            al_draw_filled_rounded_rectangle(dx, dy, dw, dh, 10, 10, al_map_rgba_f(group_colors[i][0], group_colors[i][1], group_colors[i][2], 0.25));
-            al_draw_text(font, al_map_rgb(25, 25, 25), dx + 10, dy + 10, 0, ss.str().c_str());
 
-        }
 
-    }
+#if !defined(HEADLESS)
+static ALLEGRO_EVENT_QUEUE* queue;
+static ALLEGRO_DISPLAY* disp;
+static ALLEGRO_TIMER* timer;
+static ALLEGRO_FONT* font;
+static ALLEGRO_BITMAP* field;
+#endif
 
 
-    if(draw_nodes) {
+static MPI_Comm MPI_COMM_LOCAL;
+static MPI_Comm MPI_COMM_GRID;
+static MPI_Win MPI_LOCAL_WINDOW;
+static MPI_Datatype MPI_TYPE_ROW_UP;
+static MPI_Datatype MPI_TYPE_ROW_DOWN;
+static MPI_Datatype MPI_TYPE_FACE_UP;
+static MPI_Datatype MPI_TYPE_FACE_DOWN;
+static MPI_Datatype MPI_TYPE_COLUMNS_LEFT;
+static MPI_Datatype MPI_TYPE_COLUMNS_RIGHT;
+static MPI_Datatype MPI_TYPE_COLUMNS_BARRIER;
+static MPI_Datatype MPI_TYPE_HALO_UP;
+static MPI_Datatype MPI_TYPE_HALO_DOWN;
+static MPI_Datatype MPI_TYPE_TILE;
+static MPI_Datatype MPI_TYPE_TILE_HALO;
 
 
-        static double nodes_colors[8][3] = {
-            { 1.0, 0.2, 0.2 },
-            { 0.2, 1.0, 0.2 },
-            { 0.2, 0.2, 1.0 },
-            { 0.5, 0.5, 0.5 },
-            { 0.8, 0.2, 0.6 },
-            { 0.6, 0.8, 0.2 },
-            { 0.2, 0.8, 0.6 },
-            { 0.8, 0.8, 0.6 },
-        };
+static int world_rank;
+static int world_num_procs;
 
+static int local_rank;
+static int local_num_procs;
 
-        const double n = world_num_procs;
-        const double h = VIEWPORT_HEIGHT / world_num_procs;
 
-        for(auto i = 0; i < n; i++) {
 
-            const double dx = 40;
-            const double dw = WINDOW_WIDTH - 20;
-            const double dy = (i * h) * VIEWPORT_BLOCKSIZE + 5;
-            const double dh = (dy + (h * VIEWPORT_BLOCKSIZE)) - 10;
+struct peer {
 
-            
-            std::stringstream ss1, ss2;
-            ss1 << i % world_num_procs;
-            ss2 << i % local_num_procs;
+    int rank  = MPI_PROC_NULL;
+    int local = MPI_UNDEFINED;
 
-            al_draw_filled_rounded_rectangle(dx, dy, dw, dh, 10, 10, al_map_rgba_f(nodes_colors[i][0], nodes_colors[i][1], nodes_colors[i][2], 0.75));
+    size_t width  = 0;
+    size_t height = 0;
 
-            al_draw_text(font, al_map_rgb(25, 25, 25), dx + 10, dy + 10, 0, ss1.str().c_str());
-            al_draw_text(font, al_map_rgb(25, 25, 25), dw - 20, dy + 10, 0, ss2.str().c_str());
+    void* segment = nullptr;
 
-        }
 
+    explicit operator bool() const {
+        return rank != MPI_PROC_NULL;
     }
 
+    bool remote() const {
+        return local == MPI_UNDEFINED;
+    }
 
-    if(current_unit) {
+};
 
-        std::stringstream ss;
-        ss << "Unit(" << current_unit_x << ", " << current_unit_y << ") "
-           << "Density: " << current_unit->new_rho() << ", Curl: " << current_unit->curl << ", "
-           << "Speed: X(" << current_unit->u.x() << "," << current_unit->u.y() << ") " << current_unit->u.len();
 
-        al_draw_text(font, al_map_rgb(25, 25, 25), 10, WINDOW_HEIGHT - 15, 0, ss.str().c_str());
+static peer up_peer;
+static peer bottom_peer;
+static peer left_peer;
+static peer right_peer;
+
+/**
+ * The viewport fills the window unless a headless run is given its size.
+ */
+static size_t viewport_width  = VIEWPORT_WIDTH;
+static size_t viewport_height = VIEWPORT_HEIGHT;
+
+static int grid_width  = 1;
+static int grid_height = 1;
+static int grid_row    = 0;
+static int grid_column = 0;
+
+static size_t block_width  = 0;
+static size_t block_height = 0;
+
+static size_t halo_width = 0;
+static size_t halo_left  = 0;
+static size_t halo_right = 0;
+
+/**
+ * The viewport is split at column_offsets and row_offsets, as evenly as the
+ * cells allow, and the load balancer moves the rows. regions holds every
+ * rank's block in viewport cells, frame_counts and frame_offsets its span
+ * of shades, where the primary gathers frames.
+ */
+struct region {
+    size_t x, y, width, height;
+};
 
-    }
+static std::vector<size_t> column_offsets;
+static std::vector<size_t> row_offsets;
+static std::vector<double> row_speeds;
+static std::vector<region> regions;
 
+static std::vector<int> frame_counts;
+static std::vector<int> frame_offsets;
+static std::vector<uint16_t> shades;
 
 
+/**
+ * Gathered frames reach the render thread through a triple buffer. The
+ * solver fills frames[frame_filling] and swaps it with the middle slot; the
+ * render thread swaps its frames[frame_showing] for the middle slot when a
+ * fresher one is there. Neither side ever waits for the other. Each buffer
+ * carries the decomposition it was gathered with, for the overlays.
+ */
+struct frame_buffer {
 
-}
+    std::vector<uint16_t> shades;
+    uint8_t mode;
 
+    int64_t probe = -1;
+    double probed[4];
 
+    std::vector<region> regions;
+    std::vector<size_t> rows;
 
+};
 
+#define FRAME_FRESH                 4
 
-void update(ALLEGRO_EVENT* e) {
+static frame_buffer frames[3];
+static std::atomic<int> frame_middle(1);
+static int frame_filling = 0;
 
+#if !defined(HEADLESS)
+static int frame_showing = 2;
+#endif
 
-    switch(e->type) {
 
-        case ALLEGRO_EVENT_KEY_DOWN:
+/**
+ * Guards what the render thread hands to the solver: requested, the barrier
+ * edits and viewport_barrier, which only the UI writes.
+ */
+static std::mutex ui_lock;
 
-            
-            if(e->keyboard.keycode == ALLEGRO_KEY_ESCAPE) 
-                running = false;
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_C)
-                clear();
+static lattice up_units;
+static lattice bottom_units;
+static lattice units;
+static lattice back_units;
+static std::vector<bool> viewport_barrier;
+static std::vector<uint16_t> block_shades;
+
+#if defined(BENCH)
+static lattice snapshot;
+static lattice frame;
+static MPI_Datatype MPI_TYPE_SNAPSHOT;
+#endif
+
+static lattice up_tiles[2];
+static lattice bottom_tiles[2];
+static size_t tile_depth = 1;
+
+static size_t units_segment = 0;
+static void* units_data = nullptr;
+static bool units_primed = false;
+static bool units_swapped = false;
+
+static std::vector<size_t> bounce_links[model::q];
+static std::vector<std::pair<size_t, size_t>> fluid_spans;
+
+static size_t unit_width  = 0;
+static size_t unit_height = 0;
+static size_t unit_size   = 0;
+
+#if !defined(HEADLESS)
+
+static ssize_t current_unit = -1;
+
+static uint16_t current_unit_x = 0;
+static uint16_t current_unit_y = 0;
+
+#endif
+
+
+
+
+static v2d flow_speed = v2d(WIND_SPEED, 0.0);
+static accum flow_viscosity = WIND_VISCOSITY;
+
+static bool running = true;
+static bool resetting = true;
+static bool gathering = false;
+static bool paused = false;
+static uint8_t draw_mode = 0;
+static int64_t probe = -1;
+
+#if !defined(HEADLESS)
+static bool draw_groups = false;
+static bool draw_nodes = false;
+#endif
+
+
+/**
+ * Settings the primary's UI asks for. They reach every rank, the primary
+ * included, through control_exchange(), so all ranks apply them on the same
+ * iteration.
+ */
+struct control {
+
+    uint32_t epoch;
+
+    bool running;
+    bool paused;
+    bool resetting;
+    bool gathering;
+
+    uint8_t draw_mode;
+
+    accum viscosity;
+    v2d speed;
+
+    uint32_t edits;
+
+    int64_t probe;
+
+};
+
+static control requested = { 0, true, false, false, false, 0, WIND_VISCOSITY, v2d(WIND_SPEED, 0.0), 0, -1 };
+
+/* Barrier cells painted since the last control message, as viewport indices */
+static std::vector<uint32_t> barrier_edits;
+
+static int engine = ENGINE;
+static int simd = SIMD_NONE;
+static int num_threads = 1;
+
+static double busy_time = 0.0;
+
+
+
+
+
+
+
+static struct {
+
+    std::vector<std::thread> workers;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    void (*run)(const void*, int) = nullptr;
+    const void* task = nullptr;
+
+    size_t generation = 0;
+    int pending = 0;
+    bool quit = false;
+
+} pool;
+
+
+
+static void pin(int t) {
+
+    const int cpus = std::max(1u, std::thread::hardware_concurrency());
+
+    int cpu;
+
+    switch(PINNING) {
+
+        case PINNING_COMPACT:
+            cpu = (local_rank * num_threads + t) % cpus;
+            break;
+
+        case PINNING_SCATTER:
+            cpu = (t * local_num_procs + local_rank) % cpus;
+            break;
+
+        default:
+            return;
+
+    }
+
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+}
+
+
+static void worker(int t) {
+
+
+    pin(t);
+
+
+    size_t seen = 0;
+
+    std::unique_lock<std::mutex> guard(pool.lock);
+
+    for(;;) {
+
+        pool.wake.wait(guard, [&] { return pool.quit || pool.generation != seen; });
+
+        if(pool.quit)
+            return;
+
+
+        seen = pool.generation;
+
+        const auto run  = pool.run;
+        const auto task = pool.task;
+
+        guard.unlock();
+        run(task, t);
+        guard.lock();
+
+
+        if(--pool.pending == 0)
+            pool.done.notify_one();
+
+    }
+
+}
+
+
+/**
+ * Runs f(t) on every thread of the pool, t = 0 on the calling one, and
+ * returns when all of them are done. Only the calling thread talks to MPI.
+ * The time spent here adds up in busy_time, which the load balancer reads.
+ */
+template<typename F>
+static void parallel(const F& f) {
+
+
+    const auto start = MPI_Wtime();
+
+
+    if(num_threads > 1) {
+
+        {
+
+            std::lock_guard<std::mutex> guard(pool.lock);
+
+            pool.run     = [] (const void* task, int t) { (*(const F*) task)(t); };
+            pool.task    = &f;
+            pool.pending = num_threads - 1;
+            pool.generation++;
+
+        }
+
+        pool.wake.notify_all();
+
+    }
+
+
+    f(0);
+
+
+    if(num_threads > 1) {
+
+        std::unique_lock<std::mutex> guard(pool.lock);
+        pool.done.wait(guard, [] { return pool.pending == 0; });
+
+    }
+
+
+    busy_time += MPI_Wtime() - start;
+
+}
+
+
+static void partition(int t, size_t count, size_t& first, size_t& last) {
+
+    first = count * t / num_threads;
+    last  = count * (t + 1) / num_threads;
+
+}
+
+
+static void pool_start() {
+
+
+#if THREADS > 0
+    num_threads = THREADS;
+#else
+    num_threads = std::max(1, (int) std::thread::hardware_concurrency() / local_num_procs);
+#endif
+
+
+    pin(0);
+
+    for(auto t = 1; t < num_threads; t++)
+        pool.workers.emplace_back(worker, t);
+
+}
+
+
+static void pool_stop() {
+
+
+    {
+
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.quit = true;
+
+    }
+
+    pool.wake.notify_all();
+
+
+    for(auto& w : pool.workers)
+        w.join();
+
+    pool.workers.clear();
+
+}
+
+
+/**
+ * Zeroes each thread's share of rows from that thread, so that the pages
+ * of a freshly mapped lattice land on the NUMA node that will work on them.
+ */
+static void first_touch(lattice& l) {
+
+    parallel([&] (int t) {
+
+        size_t first, last;
+        partition(t, l.height, first, last);
+
+        for(auto i = 0; i < LATTICE_FIELDS; i++)
+            memset(&l.n[0][i * l.stride + XY(0, first, l.width)], 0, (last - first) * l.width * sizeof(real));
+
+        memset(&l.barrier[XY(0, first, l.width)], 0, (last - first) * l.width * sizeof(bool));
+
+    });
+
+}
+
+
+
+
+
+
+
+#if !defined(HEADLESS)
+
+void HSVtoRGB(int H, double S, double V, int output[3]) {
+
+
+    double C = S * V;
+    double X = C * (1 - abs(fmod(H / 60.0, 2) - 1));
+    double m = V - C;
+    double Rs, Gs, Bs;
+
+
+    if(H >= 0 && H < 60) {
+        Rs = C;
+        Gs = X;
+        Bs = 0;	
+    }
+
+    else if(H >= 60 && H < 120) {	
+        Rs = X;
+        Gs = C;
+        Bs = 0;	
+    }
+
+    else if(H >= 120 && H < 180) {
+        Rs = 0;
+        Gs = C;
+        Bs = X;	
+    }
+
+    else if(H >= 180 && H < 240) {
+        Rs = 0;
+        Gs = X;
+        Bs = C;	
+    }
+
+    else if(H >= 240 && H < 300) {
+        Rs = X;
+        Gs = 0;
+        Bs = C;	
+    }
+
+    else {
+        Rs = C;
+        Gs = 0;
+        Bs = X;	
+    }
+    
+    output[0] = (Rs + m) * 255;
+    output[1] = (Gs + m) * 255;
+    output[2] = (Bs + m) * 255;
+
+
+}
+
+
+
+/**
+ * The colors redraw() maps values to, one per step of the 0..1024 scale,
+ * packed as ALLEGRO_PIXEL_FORMAT_ABGR_8888 pixels.
+ */
+static uint32_t colormap[1025];
+
+static void colormap_init() {
+
+    for(auto c = 0; c <= 1024; c++) {
+
+        int out[3];
+        HSVtoRGB((c / 1024.0) * (2.0 / 3.0) * 360.0 + 90, 0.75, 1, out);
+
+        colormap[c] = (uint32_t) (uint8_t) out[0]
+                    | (uint32_t) (uint8_t) out[1] << 8
+                    | (uint32_t) (uint8_t) out[2] << 16
+                    | 0xff000000u;
+
+    }
+
+}
+
+#endif
+
+
+
+void reset() {
+    requested.resetting = true;
+}
+
+
+void clear() {
+
+    std::fill(viewport_barrier.begin(), viewport_barrier.end(), false);
+
+    reset();
+
+}
+
+
+void setDirection(double x, double y) {
+
+    requested.speed.x() = WIND_SPEED * x;
+    requested.speed.y() = WIND_SPEED * y;
+
+    reset();
+
+}
+
+
+void setBarrier(int x, int y) {
+
+    if(x <= 0 || y <= 0 || x >= (int) viewport_width - 1 || y >= (int) viewport_height - 1)
+        return;
+
+    if(viewport_barrier[XY(x, y, viewport_width)])
+        return;
+
+
+    viewport_barrier[XY(x, y, viewport_width)] = true;
+
+    barrier_edits.push_back(XY(x, y, viewport_width));
+
+}
+
+
+
+#if !defined(HEADLESS)
+
+void setCurrentUnit(int x, int y) {
+
+    if(x < 0 || y < 0 || x > (int) viewport_width - 1 || y > (int) viewport_height - 1)
+        return;
+
+    if(viewport_barrier[XY(x, y, viewport_width)])
+        return;
+
+    current_unit = XY(x, y, viewport_width);
+    current_unit_x = x;
+    current_unit_y = y;
+
+    requested.probe = current_unit;
+
+}
+
+
+/**
+ * Colors row y of the shown frame into pixels. Next to block edges, where
+ * the vorticity of the halos shows, curl is blurred over the rows around
+ * into blurred, a row the caller owns.
+ */
+static void colorize(uint32_t* pixels, int y, const frame_buffer& shown, bool seam, uint16_t* blurred) {
+
+
+    const auto k = XY(0, y, viewport_width);
+
+    const uint16_t* row = &shown.shades[k];
+
+
+    if(seam && shown.mode == 0) {
+
+        constexpr int steps = 8;
+
+        for(size_t x = 0; x < viewport_width; x++) {
+
+            int value = row[x];
+
+            for(auto n = 0; n < (steps >> 1); n++)
+                value += shown.shades[XY(x, y - n, viewport_width)];
+
+            for(auto n = 0; n < (steps >> 1); n++)
+                value += shown.shades[XY(x, y + n, viewport_width)];
+
+            blurred[x] = value / steps;
+
+        }
+
+        row = blurred;
+
+    }
+
+
+    for(size_t x = 0; x < viewport_width; x++)
+        pixels[x] = viewport_barrier[k + x] ? 0xff000000u : colormap[row[x]];
+
+}
+
+
+/**
+ * The render thread colors frames together with RENDER_THREADS - 1 painters.
+ * They live as long as the render thread and each owns a row for the seam
+ * blur, so drawing a frame neither starts threads nor allocates. The solver's
+ * pool can't help here, since only the solver thread drives it.
+ */
+static struct {
+
+    std::vector<std::thread> workers;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    const frame_buffer* shown = nullptr;
+    const ALLEGRO_LOCKED_REGION* locked = nullptr;
+
+    std::vector<bool> seams;
+    std::vector<std::vector<uint16_t>> blurred;
+
+    size_t generation = 0;
+    int pending = 0;
+    bool quit = false;
+
+} painters;
+
+
+static void paint(int t) {
+
+    for(auto y = viewport_height * t / RENDER_THREADS; y < viewport_height * (t + 1) / RENDER_THREADS; y++)
+        colorize((uint32_t*) ((uint8_t*) painters.locked->data + y * painters.locked->pitch), y, *painters.shown, painters.seams[y], painters.blurred[t].data());
+
+}
+
+
+static void painter(int t) {
+
+
+    size_t seen = 0;
+
+    std::unique_lock<std::mutex> guard(painters.lock);
+
+    for(;;) {
+
+        painters.wake.wait(guard, [&] { return painters.quit || painters.generation != seen; });
+
+        if(painters.quit)
+            return;
+
+
+        seen = painters.generation;
+
+        guard.unlock();
+        paint(t);
+        guard.lock();
+
+
+        if(--painters.pending == 0)
+            painters.done.notify_one();
+
+    }
+
+}
+
+
+static void painters_start() {
+
+
+    painters.seams.assign(viewport_height, false);
+    painters.blurred.assign(RENDER_THREADS, std::vector<uint16_t>(viewport_width));
+
+    for(auto t = 1; t < RENDER_THREADS; t++)
+        painters.workers.emplace_back(painter, t);
+
+}
+
+
+static void painters_stop() {
+
+
+    {
+
+        std::lock_guard<std::mutex> guard(painters.lock);
+        painters.quit = true;
+
+    }
+
+    painters.wake.notify_all();
+
+
+    for(auto& w : painters.workers)
+        w.join();
+
+    painters.workers.clear();
+
+}
+
+
+/**
+ * Colors the frame into field, one pixel per cell, with the painters, and
+ * scales it to the window in a single draw.
+ */
+void redraw(ALLEGRO_EVENT* e) {
+
+
+    const auto& shown = frames[frame_showing];
+
+
+    constexpr int steps = 8;
+    constexpr int averg = 3;
+
+    for(auto y = steps + 1; y < (int) viewport_height - steps; y++) {
+
+        painters.seams[y] = std::any_of(shown.rows.begin(), shown.rows.end(), [&] (size_t o) {
+            return (size_t) y + averg >= o && (size_t) y < o + averg;
+        });
+
+    }
+
+
+    auto* locked = al_lock_bitmap(field, ALLEGRO_PIXEL_FORMAT_ABGR_8888, ALLEGRO_LOCK_WRITEONLY);
+
+    if(locked) {
+
+        {
+
+            std::lock_guard<std::mutex> guard(painters.lock);
+
+            painters.shown   = &shown;
+            painters.locked  = locked;
+            painters.pending = RENDER_THREADS - 1;
+            painters.generation++;
+
+        }
+
+        painters.wake.notify_all();
+
+
+        paint(0);
+
+
+        if(RENDER_THREADS > 1) {
+
+            std::unique_lock<std::mutex> guard(painters.lock);
+            painters.done.wait(guard, [] { return painters.pending == 0; });
+
+        }
+
+
+        al_unlock_bitmap(field);
+
+    }
+
+
+    al_draw_scaled_bitmap(field, 0, 0, viewport_width, viewport_height, 0, 0, viewport_width * VIEWPORT_BLOCKSIZE, viewport_height * VIEWPORT_BLOCKSIZE, 0);
+
+
+
+    if(draw_groups) {
+
+
+        static double group_colors[8][3] = {
+            { 1.0, 0.2, 0.2 },
+            { 0.2, 1.0, 0.2 },
+            { 0.2, 0.2, 1.0 },
+            { 0.5, 0.5, 0.5 },
+            { 0.8, 0.2, 0.6 },
+            { 0.6, 0.8, 0.2 },
+            { 0.2, 0.8, 0.6 },
+            { 0.8, 0.8, 0.6 },
+        };
+
+
+        for(auto i = 0; i < world_num_procs; i++) {
+
+            const auto g = (i / local_num_procs) % 8;
+
+            const auto& r = shown.regions[i];
+
+            const double dx = r.x * VIEWPORT_BLOCKSIZE + 2;
+            const double dw = (dx + (r.width * VIEWPORT_BLOCKSIZE)) - 4;
+            const double dy = r.y * VIEWPORT_BLOCKSIZE + 2;
+            const double dh = (dy + (r.height * VIEWPORT_BLOCKSIZE)) - 4;
+
+            std::stringstream ss;
+            ss << i / local_num_procs;
+
+            al_draw_filled_rounded_rectangle(dx, dy, dw, dh, 10, 10, al_map_rgba_f(group_colors[g][0], group_colors[g][1], group_colors[g][2], 0.25));
+            al_draw_text(font, al_map_rgb(25, 25, 25), dx + 10, dy + 10, 0, ss.str().c_str());
+
+        }
+
+    }
+
+
+    if(draw_nodes) {
+
+
+        static double nodes_colors[8][3] = {
+            { 1.0, 0.2, 0.2 },
+            { 0.2, 1.0, 0.2 },
+            { 0.2, 0.2, 1.0 },
+            { 0.5, 0.5, 0.5 },
+            { 0.8, 0.2, 0.6 },
+            { 0.6, 0.8, 0.2 },
+            { 0.2, 0.8, 0.6 },
+            { 0.8, 0.8, 0.6 },
+        };
+
+
+        for(auto i = 0; i < world_num_procs; i++) {
+
+            const auto n = i % 8;
+
+            const auto& r = shown.regions[i];
+
+            const double dx = r.x * VIEWPORT_BLOCKSIZE + 5;
+            const double dw = (dx + (r.width * VIEWPORT_BLOCKSIZE)) - 10;
+            const double dy = r.y * VIEWPORT_BLOCKSIZE + 5;
+            const double dh = (dy + (r.height * VIEWPORT_BLOCKSIZE)) - 10;
+
+            
+            std::stringstream ss1, ss2;
+            ss1 << i % world_num_procs;
+            ss2 << i % local_num_procs;
+
+            al_draw_filled_rounded_rectangle(dx, dy, dw, dh, 10, 10, al_map_rgba_f(nodes_colors[n][0], nodes_colors[n][1], nodes_colors[n][2], 0.75));
+
+            al_draw_text(font, al_map_rgb(25, 25, 25), dx + 10, dy + 10, 0, ss1.str().c_str());
+            al_draw_text(font, al_map_rgb(25, 25, 25), dw - 20, dy + 10, 0, ss2.str().c_str());
+
+        }
+
+    }
+
+
+    if(current_unit >= 0 && shown.probe == current_unit) {
+
+        const auto* p = shown.probed;
+
+        std::stringstream ss;
+        ss << "Unit(" << current_unit_x << ", " << current_unit_y << ") "
+           << "Density: " << p[0] << ", Curl: " << p[3] << ", "
+           << "Speed: X(" << p[1] << "," << p[2] << ") " << std::sqrt(p[1] * p[1] + p[2] * p[2]);
+
+        al_draw_text(font, al_map_rgb(25, 25, 25), 10, WINDOW_HEIGHT - 15, 0, ss.str().c_str());
+
+    }
+
+
+
+
+}
+
+
+
+
+
+void update(ALLEGRO_EVENT* e) {
+
+
+    switch(e->type) {
+
+        case ALLEGRO_EVENT_KEY_DOWN:
+
+            
+            if(e->keyboard.keycode == ALLEGRO_KEY_ESCAPE) 
+                requested.running = false;
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_C)
+                clear();
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_P)
+                requested.paused = !requested.paused;
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_I)
+                draw_groups = !draw_groups;
+            
+            else if(e->keyboard.keycode == ALLEGRO_KEY_U)
+                draw_nodes = !draw_nodes;
+
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_7)
+                setDirection(-0.5, -0.5);
+            
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_8)
+                setDirection(   0, -1.0);
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_9)
+                setDirection( 0.5, -0.5);
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_4)
+                setDirection(-1.0,  0.0);
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_5)
+                setDirection( 0.0,  0.0);
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_6)
+                setDirection( 1.0,  0.0);
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_1)
+                setDirection(-0.5,  0.5);
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_2)
+                setDirection( 0.0,  1.0);
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_3)
+                setDirection( 0.5,  0.5);
+
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_1)
+                requested.draw_mode = 0;
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_2)
+                requested.draw_mode = 1;
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_3)
+                requested.draw_mode = 2;
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_4)
+                requested.draw_mode = 3;
+
+            else if(e->keyboard.keycode == ALLEGRO_KEY_5)
+                requested.draw_mode = 4;
+
+            break;
+
+
+        case ALLEGRO_EVENT_MOUSE_BUTTON_DOWN:
+        case ALLEGRO_EVENT_MOUSE_AXES:
+
+            if(e->mouse.pressure > 0) {
+
+                setBarrier(e->mouse.x / VIEWPORT_BLOCKSIZE, e->mouse.y / VIEWPORT_BLOCKSIZE);
+
+            }
+
+
+            setCurrentUnit(e->mouse.x / VIEWPORT_BLOCKSIZE, e->mouse.y / VIEWPORT_BLOCKSIZE);
+
+            break;
+
+    }
+
+
+
+}
+
+#endif
+
+
+
+
+
+template<int N>
+static inline __attribute__((always_inline)) size_t collide_simd(lattice& l, size_t k, size_t end, bool swap, const accum w) {
+
+
+    typedef typename vec<accum, N>::d vd;
+    typedef typename vec<accum, N>::m vm;
+
+
+    for(; k + N <= end; k += N) {
+
+        vd n[model::q], f[model::q], u[model::d], rho;
+        vm barrier;
+
+        unroll<model::q>([&] (auto i) {
+
+            load(n[i], &l.n[i][k]);
+            f[i] = n[i];
+
+        });
+
+        load(barrier, &l.barrier[k]);
+
+
+        moments(f, rho, u);
+        relax(f, u, w, rho);
+
+
+        unroll<model::q>([&] (auto i) {
+
+            const int d = swap ? model::opposite[i] : i;
+
+            store(&l.n[d][k], barrier ? n[d] : f[i]);
+
+        });
+
+
+        vd oux, ouy, orho;
+
+        load(oux,  &l.ux[k]);
+        load(ouy,  &l.uy[k]);
+        load(orho, &l.rho[k]);
+
+        store(&l.ux[k],  barrier ? oux  : u[0]);
+        store(&l.uy[k],  barrier ? ouy  : u[1]);
+        store(&l.rho[k], barrier ? orho : rho);
+
+    }
+
+    return k;
+
+}
+
+
+template<int N>
+static inline __attribute__((always_inline)) size_t stream_collide_simd(lattice& dst, const lattice& src, const lattice* const rows[3], const size_t base[3], size_t x, size_t end, size_t y, const accum w) {
+
+
+    typedef typename vec<accum, N>::d vd;
+    typedef typename vec<accum, N>::m vm;
+
+    const vd zero = { };
+
+
+    for(; x + N <= end; x += N) {
+
+        const auto k = XY(x, y, src.width);
+
+        vd f[model::q], u[model::d], rho;
+        vm barrier;
+
+
+        unroll<model::q>([&] (auto i) {
+
+            constexpr int ex = model::e[i][0];
+            constexpr int ey = model::e[i][1];
+
+            const auto* row = rows[1 - ey];
+            const auto sk   = base[1 - ey] + x - ex;
+
+            vd opp;
+
+            load(f[i],    &row->n[i][sk]);
+            load(barrier, &row->barrier[sk]);
+            load(opp,     &src.n[model::opposite[i]][k]);
+
+            f[i] = barrier ? f[i] + opp : f[i];
+
+        });
+
+
+        moments(f, rho, u);
+        relax(f, u, w, rho);
+
+
+        load(barrier, &src.barrier[k]);
+
+        unroll<model::q>([&] (auto i) {
+            store(&dst.n[i][k], barrier ? zero : f[i]);
+        });
+
+        store(&dst.ux[k],  barrier ? zero : u[0]);
+        store(&dst.uy[k],  barrier ? zero : u[1]);
+        store(&dst.rho[k], barrier ? zero : rho);
+
+    }
+
+    return x;
+
+}
+
+
+template<int N>
+static inline __attribute__((always_inline)) size_t stream_collide_aa_simd(lattice& l, lattice* const rows[3], const size_t base[3], size_t x, size_t end, size_t y, const accum w) {
+
+
+    typedef typename vec<accum, N>::d vd;
+    typedef typename vec<accum, N>::m vm;
+
+    const vd zero = { };
+
+
+    for(; x + N <= end; x += N) {
+
+        const auto k = XY(x, y, l.width);
+
+        vd f[model::q], u[model::d], rho;
+        vm barrier, solid[model::q];
+
+
+        load(barrier, &l.barrier[k]);
+
+        vm any = barrier;
+
+        unroll<model::q>([&] (auto i) {
+
+            constexpr int ex = model::e[i][0];
+            constexpr int ey = model::e[i][1];
+
+            load(solid[i], &rows[1 - ey]->barrier[base[1 - ey] + x - ex]);
+
+            any |= solid[i];
+
+        });
+
+
+        bool fluid = true;
+
+        for(auto j = 0; j < N; j++)
+            fluid &= !any[j];
+
+
+
+        unroll<model::q>([&] (auto i) {
+
+            constexpr int ex = model::e[i][0];
+            constexpr int ey = model::e[i][1];
+
+            load(f[i], &rows[1 - ey]->n[model::opposite[i]][base[1 - ey] + x - ex]);
+
+            if(!fluid) {
+
+                vd own;
+                load(own, &l.n[i][k]);
+
+                f[i] = solid[i] ? zero + own : f[i];
+
+            }
+
+        });
+
+
+        moments(f, rho, u);
+        relax(f, u, w, rho);
+
+
+
+        if(fluid) {
+
+            unroll<model::q>([&] (auto i) {
+
+                constexpr int ex = model::e[i][0];
+                constexpr int ey = model::e[i][1];
+
+                store(&rows[1 + ey]->n[i][base[1 + ey] + x + ex], f[i]);
+
+            });
+
+            store(&l.ux[k],  u[0]);
+            store(&l.uy[k],  u[1]);
+            store(&l.rho[k], rho);
+
+            continue;
+
+        }
+
+
+        unroll<model::q>([&] (auto i) {
+
+            constexpr int ex = model::e[i][0];
+            constexpr int ey = model::e[i][1];
+            constexpr int o  = model::opposite[i];
+
+            auto* row     = rows[1 + ey];
+            const auto tk = base[1 + ey] + x + ex;
+
+            const vm& target = solid[o];
+
+            vd next, own;
+
+            load(own, &l.n[o][k]);
+            store(&l.n[o][k], (~barrier & target) ? f[i] : own);
+
+            load(next, &row->n[i][tk]);
+            store(&row->n[i][tk], (barrier | target) ? next : f[i]);
+
+        });
+
+
+        vd oux, ouy, orho;
+
+        load(oux,  &l.ux[k]);
+        load(ouy,  &l.uy[k]);
+        load(orho, &l.rho[k]);
+
+        store(&l.ux[k],  barrier ? oux  : u[0]);
+        store(&l.uy[k],  barrier ? ouy  : u[1]);
+        store(&l.rho[k], barrier ? orho : rho);
+
+    }
+
+    return x;
+
+}
+
+
+
+__attribute__((target("avx2,fma")))
+static size_t collide_avx2(lattice& l, size_t k, size_t end, bool swap, const accum w) {
+    return collide_simd<32 / sizeof(accum)>(l, k, end, swap, w);
+}
+
+__attribute__((target("avx512f")))
+static size_t collide_avx512(lattice& l, size_t k, size_t end, bool swap, const accum w) {
+    return collide_simd<64 / sizeof(accum)>(l, k, end, swap, w);
+}
+
+__attribute__((target("avx2,fma")))
+static size_t stream_collide_avx2(lattice& dst, const lattice& src, const lattice* const rows[3], const size_t base[3], size_t x, size_t end, size_t y, const accum w) {
+    return stream_collide_simd<32 / sizeof(accum)>(dst, src, rows, base, x, end, y, w);
+}
+
+__attribute__((target("avx512f")))
+static size_t stream_collide_avx512(lattice& dst, const lattice& src, const lattice* const rows[3], const size_t base[3], size_t x, size_t end, size_t y, const accum w) {
+    return stream_collide_simd<64 / sizeof(accum)>(dst, src, rows, base, x, end, y, w);
+}
+
+__attribute__((target("avx2,fma")))
+static size_t stream_collide_aa_avx2(lattice& l, lattice* const rows[3], const size_t base[3], size_t x, size_t end, size_t y, const accum w) {
+    return stream_collide_aa_simd<32 / sizeof(accum)>(l, rows, base, x, end, y, w);
+}
+
+__attribute__((target("avx512f")))
+static size_t stream_collide_aa_avx512(lattice& l, lattice* const rows[3], const size_t base[3], size_t x, size_t end, size_t y, const accum w) {
+    return stream_collide_aa_simd<64 / sizeof(accum)>(l, rows, base, x, end, y, w);
+}
+
+
+
+
+
+static void inflow(accum f[model::q]) {
+
+    for(auto i = 0; i < model::q; i++)
+        f[i] = accum(model::w[i]) * (1 + 3 * v2d::dot(direction(i), flow_speed) + 4.5 * v2d::dot2(direction(i), flow_speed) - 1.5 * flow_speed.len2());
+
+}
+
+
+void collide() {
+
+
+    accum inlet[model::q];
+
+    inflow(inlet);
+
+
+    parallel([&] (int t) {
+
+
+        size_t first, last;
+        partition(t, unit_height, first, last);
+
+        const auto begin = XY(0, first, unit_width);
+        const auto end   = XY(0, last,  unit_width);
+
+
+        auto span = std::lower_bound(fluid_spans.begin(), fluid_spans.end(), begin, [] (const std::pair<size_t, size_t>& s, size_t k) {
+            return s.second <= k;
+        });
+
+        for(; span != fluid_spans.end() && span->first < end; span++) {
+
+            auto k = std::max(span->first, begin);
+
+            const auto stop = std::min(span->second, end);
+
+            switch(simd) {
+
+                case SIMD_AVX512:
+                    k = collide_avx512(units, k, stop, false, flow_viscosity);
+                    break;
+
+                case SIMD_AVX2:
+                    k = collide_avx2(units, k, stop, false, flow_viscosity);
+                    break;
+
+            }
+
+
+            for(; k < stop; k++) {
+
+                accum f[model::q], u[model::d], rho;
+
+                for(auto i = 0; i < model::q; i++)
+                    f[i] = units.n[i][k];
+
+
+                moments(f, rho, u);
+                relax(f, u, flow_viscosity, rho);
+
+
+                for(auto i = 0; i < model::q; i++)
+                    units.n[i][k] = f[i];
+
+                units.ux[k]  = u[0];
+                units.uy[k]  = u[1];
+                units.rho[k] = rho;
+
+            }
+
+        }
+
+
+
+        for(auto y = first; y < last; y++) {
+
+            for(auto i = 0; i < model::q; i++) {
+
+                if(model::e[i][0] > 0)
+                    units.n[i][XY(0, y, unit_width)] = inlet[i];
+
+                if(model::e[i][0] < 0)
+                    units.n[i][XY(unit_width - 1, y, unit_width)] = inlet[i];
+
+            }
+
+        }
+
+    });
+
+}
+
+
+
+
+static void stream_rows(lattice& l, int i, size_t first, size_t last) {
+
+
+    const int ex = model::e[i][0];
+    const int ey = model::e[i][1];
+
+    const auto w = l.width;
+
+
+    if(ex == 0) {
+
+        memmove(&l.n[i][XY(0, first, w)], &l.n[i][XY(0, first - ey, w)], (last - first) * w * sizeof(real));
+        return;
+
+    }
+
+
+    for(size_t r = 0; r < last - first; r++) {
+
+        const auto y = ey > 0 ? last - 1 - r : first + r;
+
+        memmove(&l.n[i][XY(ex > 0, y, w)], &l.n[i][XY(ex < 0, y - ey, w)], (w - 1) * sizeof(real));
+
+    }
+
+}
+
+
+/**
+ * Streams every direction accepted by select(ex, ey) over [first, last).
+ * Rows of one direction depend on each other, so the pool splits by direction.
+ */
+template<typename S>
+static void stream_rows(lattice& l, S select, size_t first, size_t last) {
+
+
+    int dirs[model::q];
+    int count = 0;
+
+    for(auto i = 1; i < model::q; i++) {
+
+        if(select(model::e[i][0], model::e[i][1]))
+            dirs[count++] = i;
+
+    }
+
+
+    parallel([&] (int t) {
+
+        for(auto j = t; j < count; j += num_threads)
+            stream_rows(l, dirs[j], first, last);
+
+    });
+
+}
+
+
+static void stream_halo(lattice& l, int i, size_t y, const lattice& halo) {
+
+    const int ex = model::e[i][0];
+
+    memcpy(&l.n[i][XY(ex > 0, y, l.width)], &halo.n[i][ex < 0], (l.width - abs(ex)) * sizeof(real));
+
+}
+
+
+
+/**
+ * Views the buffer of a peer on this node that matches l in the segment
+ * MPI_Win_shared_query() returned for the peer. The back buffer follows a
+ * front one sized by the peer's own block, which may differ from ours.
+ */
+static lattice shared_units(const peer& p, const lattice& l = units) {
+
+    const uintptr_t offset = l.n[0] == (real*) units_data ? 0 : lattice::bytes(p.width, p.height);
+
+    lattice s;
+    s.bind((void*) ((uintptr_t) p.segment + offset), p.width, p.height);
+
+    return s;
+
+}
+
+
+static lattice row_view(const lattice& l, size_t y) {
+
+    const auto k = XY(0, y, l.width);
+
+    lattice r = l;
+
+    for(auto i = 0; i < model::q; i++)
+        r.n[i] += k;
+
+    r.ux      += k;
+    r.uy      += k;
+    r.rho     += k;
+    r.curl    += k;
+    r.barrier += k;
+
+    r.height = 1;
+    r.size   = l.width;
+
+    return r;
+
+}
+
+
+/**
+ * AB and the tiled engine only read their halo rows, so the rows of peers on
+ * this node are read in place. AA pushes into its halo rows and the in-place
+ * engine fills them halfway through stream(), so both keep private copies.
+ */
+static bool zero_copy(const peer& p) {
+    return !p.remote() && (engine == ENGINE_AB || engine == ENGINE_TILED);
+}
+
+static lattice up_halo(const lattice& l = units) {
+    return zero_copy(up_peer) ? row_view(shared_units(up_peer, l), up_peer.height - 1) : up_units;
+}
+
+static lattice bottom_halo(const lattice& l = units) {
+    return zero_copy(bottom_peer) ? row_view(shared_units(bottom_peer, l), 0) : bottom_units;
+}
+
+
+
+
+/**
+ * Persistent halo transfers. The first exchange between a pair of buffers and
+ * a peer sets up MPI_Recv_init/MPI_Send_init, later ones only restart them.
+ * halo_release() drops them all whenever the decomposition changes.
+ */
+struct halo_transfer {
+
+    const void* send;
+    void* recv;
+    MPI_Datatype send_type;
+    MPI_Datatype recv_type;
+    int rank;
+
+    MPI_Request requests[2];
+
+};
+
+static std::vector<halo_transfer> halo_transfers;
+
+
+static void halo_start(const void* send, MPI_Datatype send_type, void* recv, MPI_Datatype recv_type, int rank, MPI_Request* requests) {
+
+
+    auto t = std::find_if(halo_transfers.begin(), halo_transfers.end(), [&] (const halo_transfer& t) {
+        return t.send == send && t.recv == recv && t.send_type == send_type && t.recv_type == recv_type && t.rank == rank;
+    });
+
+
+    if(t == halo_transfers.end()) {
+
+        halo_transfer n = { send, recv, send_type, recv_type, rank };
+
+        MPI_Recv_init(recv, 1, recv_type, rank, 0, MPI_COMM_WORLD, &n.requests[0]);
+        MPI_Send_init(send, 1, send_type, rank, 0, MPI_COMM_WORLD, &n.requests[1]);
+
+        t = halo_transfers.insert(halo_transfers.end(), n);
+
+    }
+
+
+    MPI_Startall(2, t->requests);
+
+    requests[0] = t->requests[0];
+    requests[1] = t->requests[1];
+
+}
+
+
+static void halo_sendrecv(const void* send, MPI_Datatype send_type, void* recv, MPI_Datatype recv_type, int rank) {
+
+    MPI_Request requests[2];
+
+    halo_start(send, send_type, recv, recv_type, rank, requests);
+    MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+
+}
+
+
+static void halo_release() {
+
+    for(auto& t : halo_transfers) {
+
+        MPI_Request_free(&t.requests[0]);
+        MPI_Request_free(&t.requests[1]);
+
+    }
+
+    halo_transfers.clear();
+
+}
+
+
+
+void stream() {
+
+
+    #define LOCAL_WIDTH     (unit_width)
+    #define LOCAL_HEIGHT    (unit_height)
+
+
+
+    stream_rows(units, [] (int ex, int ey) { return ey > 0 || (ey == 0 && ex > 0); }, 1, LOCAL_HEIGHT);
+
+
+
+
+    if(world_num_procs > 1) {
+
+
+        if(up_peer) {
+
+            /*
+             * The peer's edge row is wanted as it stands halfway through its
+             * own stream(), which the one fence per step can't pin down for a
+             * peer on this node. So every peer gets it as a message.
+             */
+            halo_sendrecv (
+                units.n[0],    MPI_TYPE_ROW_UP,
+                up_units.n[0], MPI_TYPE_FACE_DOWN, up_peer.rank
+            );
+
+
+            for(auto i = 1; i < model::q; i++) {
+
+                if(model::e[i][1] > 0)
+                    stream_halo(units, i, 0, up_units);
+
+            }
+
+
+
+            for(size_t x = 1; x < LOCAL_WIDTH - 1; x++) {
+
+                units.curl[XY(x, 0, LOCAL_WIDTH)] = (units.uy[XY(x + 1, 0, LOCAL_WIDTH)] - units.uy[XY(x - 1, 0, LOCAL_WIDTH)])
+                                                  - (units.ux[XY(x, 1, LOCAL_WIDTH)] - up_units.ux[x]);
+                
+            }
+
+
+
+            for(auto i = 1; i < model::q; i++) {
+
+                if(model::e[i][1] < 0 || (model::e[i][1] == 0 && model::e[i][0] != 0))
+                    stream_rows(units, i, 0, 1);
+
+            }
+
+
+        }
+
+
+    } else {
+
+        for(size_t x = 0; x < LOCAL_WIDTH; x++) {
+
+            units.zero(XY(x, 0, LOCAL_WIDTH));
+            units.eq(XY(x, 0, LOCAL_WIDTH), 1, 1);
+
+        }
+
+    }
+
+
+
+
+
+    stream_rows(units, [] (int ex, int ey) { return ey < 0 || (ey == 0 && ex < 0); }, 0, LOCAL_HEIGHT - 1);
+
+
+
+
+    if(world_num_procs > 1) {
+
+
+        if(bottom_peer) {
+
+            halo_sendrecv (
+                &units.n[0][XY(0, LOCAL_HEIGHT - 1, LOCAL_WIDTH)], MPI_TYPE_ROW_DOWN,
+                bottom_units.n[0],                                 MPI_TYPE_FACE_UP,  bottom_peer.rank
+            );
+
+
+            for(auto i = 1; i < model::q; i++) {
+
+                if(model::e[i][1] < 0)
+                    stream_halo(units, i, LOCAL_HEIGHT - 1, bottom_units);
+
+            }
+
+
+
+            for(size_t x = 1; x < LOCAL_WIDTH - 1; x++) {
+
+                units.curl[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)] = (units.uy[XY(x + 1, LOCAL_HEIGHT - 1, LOCAL_WIDTH)] - units.uy[XY(x - 1, LOCAL_HEIGHT - 1, LOCAL_WIDTH)])
+                                                                 - (bottom_units.ux[x] - units.ux[XY(x, LOCAL_HEIGHT - 2, LOCAL_WIDTH)]);
+                
+            }
+
+
+
+            for(auto i = 1; i < model::q; i++) {
+
+                if(model::e[i][1] > 0 || (model::e[i][1] == 0 && model::e[i][0] != 0))
+                    stream_rows(units, i, LOCAL_HEIGHT - 1, LOCAL_HEIGHT);
+
+            }
+
+
+        }
+        
+
+    } else {
+
+        for(size_t x = 0; x < LOCAL_WIDTH; x++) {
+
+            units.zero(XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH));
+            units.eq(XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH), 1, 1);
+
+        }
+
+    }
+
+
+
+
+    if(!bottom_peer) {
+
+        for(size_t x = 0; x < LOCAL_WIDTH; x++) {
+
+            units.zero(XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH));
+            units.eq(XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH), 1, 1);
+
+        }
+
+    }
+
+    if(!up_peer) {
+
+        for(size_t x = 0; x < LOCAL_WIDTH; x++) {
+
+            units.zero(XY(x, 0, LOCAL_WIDTH));
+            units.eq(XY(x, 0, LOCAL_WIDTH), 1, 1);
+
+        }
+
+    }
+
+}
+
+
+
+
+static void vorticity(lattice& l, size_t y, const real* up, const real* down) {
+
+
+    const auto w = l.width;
+
+    const auto* uy = &l.uy[XY(0, y, w)];
+
+    auto* curl = &l.curl[XY(0, y, w)];
+
+
+    for(size_t x = 1; x < w - 1; x++)
+        curl[x] = (uy[x + 1] - uy[x - 1]) - (down[x] - up[x]);
+
+
+    curl[0]     = (uy[1]     - uy[0])     - (up[0]     - down[0]);
+    curl[w - 1] = (uy[w - 1] - uy[w - 2]) - (up[w - 1] - down[w - 1]);
+
+}
+
+
+void vorticity() {
+
+    parallel([] (int t) {
+
+        size_t first, last;
+        partition(t, LOCAL_HEIGHT, first, last);
+
+        for(auto y = std::max<size_t>(first, 1); y < std::min<size_t>(last, LOCAL_HEIGHT - 1); y++)
+            vorticity(units, y, &units.ux[XY(0, y - 1, LOCAL_WIDTH)], &units.ux[XY(0, y + 1, LOCAL_WIDTH)]);
+
+    });
+
+}
+
+
+void vorticity_halo() {
+
+    const auto up     = up_halo();
+    const auto bottom = bottom_halo();
+
+    parallel([&] (int t) {
+
+        size_t first, last;
+        partition(t, LOCAL_HEIGHT, first, last);
+
+        for(auto y = first; y < last; y++) {
+
+            if(!up_peer && y == 0)
+                continue;
+
+            if(!bottom_peer && y == LOCAL_HEIGHT - 1)
+                continue;
+
+
+            vorticity(units, y, y > 0                ? &units.ux[XY(0, y - 1, LOCAL_WIDTH)] : up.ux,
+                                y < LOCAL_HEIGHT - 1 ? &units.ux[XY(0, y + 1, LOCAL_WIDTH)] : bottom.ux);
+
+        }
+
+    });
+
+}
+
+
+
+
+void compile_geometry() {
+
+
+    for(auto i = 0; i < model::q; i++)
+        bounce_links[i].clear();
+
+    fluid_spans.clear();
+
+
+
+    const auto interior = [] (int x, int y) {
+        return x > 0 && y > 0 && (size_t) x < LOCAL_WIDTH - 1 && (size_t) y < LOCAL_HEIGHT - 1;
+    };
+
+
+    for(size_t x = 1; x < LOCAL_WIDTH - 1; x++) {
+        for(size_t y = 1; y < LOCAL_HEIGHT - 1; y++) {
+
+            const auto k = XY(x, y, LOCAL_WIDTH);
+
+            if(!units.barrier[k])
+                continue;
+
+
+            for(auto i = 1; i < model::q; i++) {
+
+                const int sx = (int) x - model::e[i][0];
+                const int sy = (int) y - model::e[i][1];
+
+                if(interior(sx, sy) && units.barrier[XY(sx, sy, LOCAL_WIDTH)])
+                    continue;
+
+                bounce_links[i].push_back(k);
+
+            }
+
+        }
+    }
+
+
+
+    for(size_t k = 0; k < unit_size; ) {
+
+        for(; k < unit_size && units.barrier[k]; k++)
+            ;
+
+        const auto begin = k;
+
+        for(; k < unit_size && !units.barrier[k]; k++)
+            ;
+
+        if(k > begin)
+            fluid_spans.emplace_back(begin, k);
+
+    }
+
+}
+
+
+void bounce() {
+
+
+    /* A direction and its opposite share their two populations, so they go to the same thread */
+
+    int dirs[model::q];
+    int count = 0;
+
+    for(auto i = 1; i < model::q; i++) {
+
+        if(i < model::opposite[i])
+            dirs[count++] = i;
+
+    }
+
+
+    parallel([&] (int t) {
+
+        for(auto j = t; j < count; j += num_threads) {
+
+            for(const auto i : { dirs[j], model::opposite[dirs[j]] }) {
+
+                const int ex = model::e[i][0];
+                const int ey = model::e[i][1];
+
+                const ptrdiff_t d = ex + ey * (ptrdiff_t) LOCAL_WIDTH;
+
+                auto* src = units.n[i];
+                auto* dst = units.n[model::opposite[i]];
+
+                for(const auto k : bounce_links[i]) {
+
+                    dst[k - d] += src[k];
+                    src[k] = 0;
+
+                }
+
+            }
+
+        }
+
+    });
+
+}
+
+
+
+
+
+/**
+ * Refreshes the halo_width ghost columns on each side from the left and
+ * right peers. Up and bottom halos are taken afterwards from whole rows,
+ * ghost columns included, which is how the corner cells get across.
+ */
+void exchange_columns(bool geometry) {
+
+
+    if(grid_width == 1)
+        return;
+
+
+
+    if(left_peer) {
+
+        if(left_peer.remote()) {
+
+            halo_sendrecv (
+                &units.n[0][halo_left], MPI_TYPE_COLUMNS_LEFT,
+                units.n[0],             MPI_TYPE_COLUMNS_RIGHT, left_peer.rank
+            );
+
+            if(geometry) {
+
+                MPI_Sendrecv (
+                    &units.barrier[halo_left], 1, MPI_TYPE_COLUMNS_BARRIER, left_peer.rank, 0,
+                    units.barrier,             1, MPI_TYPE_COLUMNS_BARRIER, left_peer.rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                );
+
+            }
+
+        } else {
+
+            const auto prev = shared_units(left_peer);
+
+            for(size_t y = 0; y < LOCAL_HEIGHT; y++) {
+
+                const auto sk = XY(prev.width - 2 * halo_width, y, prev.width);
+
+                units.copy(XY(0, y, LOCAL_WIDTH), prev, sk, halo_width);
+
+                if(geometry)
+                    memcpy(&units.barrier[XY(0, y, LOCAL_WIDTH)], &prev.barrier[sk], halo_width * sizeof(bool));
+
+            }
+
+        }
+
+    }
+
+
+    if(right_peer) {
+
+        if(right_peer.remote()) {
+
+            halo_sendrecv (
+                &units.n[0][LOCAL_WIDTH - 2 * halo_width], MPI_TYPE_COLUMNS_RIGHT,
+                &units.n[0][LOCAL_WIDTH - halo_width],     MPI_TYPE_COLUMNS_LEFT,  right_peer.rank
+            );
+
+            if(geometry) {
+
+                MPI_Sendrecv (
+                    &units.barrier[LOCAL_WIDTH - 2 * halo_width], 1, MPI_TYPE_COLUMNS_BARRIER, right_peer.rank, 0,
+                    &units.barrier[LOCAL_WIDTH - halo_width],     1, MPI_TYPE_COLUMNS_BARRIER, right_peer.rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                );
+
+            }
+
+        } else {
+
+            const auto next = shared_units(right_peer);
+
+            for(size_t y = 0; y < LOCAL_HEIGHT; y++) {
+
+                const auto sk = XY(halo_width, y, next.width);
+
+                units.copy(XY(LOCAL_WIDTH - halo_width, y, LOCAL_WIDTH), next, sk, halo_width);
+
+                if(geometry)
+                    memcpy(&units.barrier[XY(LOCAL_WIDTH - halo_width, y, LOCAL_WIDTH)], &next.barrier[sk], halo_width * sizeof(bool));
+
+            }
+
+        }
+
+    }
+
+
+    if(geometry) {
+
+        for(size_t y = 0; y < LOCAL_HEIGHT; y++) {
+
+            memcpy(&back_units.barrier[XY(0, y, LOCAL_WIDTH)], &units.barrier[XY(0, y, LOCAL_WIDTH)], halo_left * sizeof(bool));
+            memcpy(&back_units.barrier[XY(LOCAL_WIDTH - halo_right, y, LOCAL_WIDTH)], &units.barrier[XY(LOCAL_WIDTH - halo_right, y, LOCAL_WIDTH)], halo_right * sizeof(bool));
+
+        }
+
+    }
+
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+}
+
+
+
+
+void exchange(bool geometry) {
+
+
+    if(world_num_procs == 1)
+        return;
+
+
+    exchange_columns(geometry);
+
+
+
+    if(up_peer) {
+
+        if(up_peer.remote()) {
+
+            halo_sendrecv (
+                units.n[0],    MPI_TYPE_ROW_UP,
+                up_units.n[0], MPI_TYPE_FACE_DOWN, up_peer.rank
+            );
+
+            if(geometry) {
+
+                MPI_Sendrecv (
+                    units.barrier,    LOCAL_WIDTH, MPI_CXX_BOOL, up_peer.rank, 0,
+                    up_units.barrier, LOCAL_WIDTH, MPI_CXX_BOOL, up_peer.rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                );
+
+            }
+
+        } else if(!zero_copy(up_peer)) {
+
+            const auto prev = shared_units(up_peer);
+
+            up_units.copy(0, prev, XY(0, prev.height - 1, LOCAL_WIDTH), LOCAL_WIDTH);
+
+            if(geometry)
+                memcpy(up_units.barrier, &prev.barrier[XY(0, prev.height - 1, LOCAL_WIDTH)], LOCAL_WIDTH * sizeof(bool));
+
+        }
+
+    }
+
+
+    if(bottom_peer) {
+
+        if(bottom_peer.remote()) {
+
+            halo_sendrecv (
+                &units.n[0][XY(0, LOCAL_HEIGHT - 1, LOCAL_WIDTH)], MPI_TYPE_ROW_DOWN,
+                bottom_units.n[0],                                 MPI_TYPE_FACE_UP,  bottom_peer.rank
+            );
+
+            if(geometry) {
+
+                MPI_Sendrecv (
+                    &units.barrier[XY(0, LOCAL_HEIGHT - 1, LOCAL_WIDTH)], LOCAL_WIDTH, MPI_CXX_BOOL, bottom_peer.rank, 0,
+                    bottom_units.barrier,                                 LOCAL_WIDTH, MPI_CXX_BOOL, bottom_peer.rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                );
+
+            }
+
+        } else if(!zero_copy(bottom_peer)) {
+
+            const auto next = shared_units(bottom_peer);
+
+            bottom_units.copy(0, next, 0, LOCAL_WIDTH);
+
+            if(geometry)
+                memcpy(bottom_units.barrier, next.barrier, LOCAL_WIDTH * sizeof(bool));
+
+        }
+
+    }
+
+}
+
+
+
+
+void exchange_tiles(bool geometry) {
+
+
+    if(world_num_procs == 1)
+        return;
+
+
+    const auto count = tile_depth * LOCAL_WIDTH;
+
+
+    if(up_peer) {
+
+        if(up_peer.remote()) {
+
+            halo_sendrecv (
+                units.n[0],       MPI_TYPE_TILE,
+                up_tiles[0].n[0], MPI_TYPE_TILE_HALO, up_peer.rank
+            );
+
+            if(geometry) {
+
+                MPI_Sendrecv (
+                    units.barrier,       count, MPI_CXX_BOOL, up_peer.rank, 0,
+                    up_tiles[0].barrier, count, MPI_CXX_BOOL, up_peer.rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                );
+
+            }
+
+        } else {
+
+            const auto prev = shared_units(up_peer);
+
+            up_tiles[0].copy(0, prev, XY(0, prev.height - tile_depth, LOCAL_WIDTH), count);
+
+            if(geometry)
+                memcpy(up_tiles[0].barrier, &prev.barrier[XY(0, prev.height - tile_depth, LOCAL_WIDTH)], count * sizeof(bool));
+
+        }
+
+        if(geometry)
+            memcpy(up_tiles[1].barrier, up_tiles[0].barrier, count * sizeof(bool));
+
+    }
+
+
+    if(bottom_peer) {
+
+        if(bottom_peer.remote()) {
+
+            halo_sendrecv (
+                &units.n[0][XY(0, LOCAL_HEIGHT - tile_depth, LOCAL_WIDTH)], MPI_TYPE_TILE,
+                bottom_tiles[0].n[0],                                       MPI_TYPE_TILE_HALO, bottom_peer.rank
+            );
+
+            if(geometry) {
+
+                MPI_Sendrecv (
+                    &units.barrier[XY(0, LOCAL_HEIGHT - tile_depth, LOCAL_WIDTH)], count, MPI_CXX_BOOL, bottom_peer.rank, 0,
+                    bottom_tiles[0].barrier,                                       count, MPI_CXX_BOOL, bottom_peer.rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE
+                );
+
+            }
+
+        } else {
+
+            const auto next = shared_units(bottom_peer);
+
+            bottom_tiles[0].copy(0, next, 0, count);
+
+            if(geometry)
+                memcpy(bottom_tiles[0].barrier, next.barrier, count * sizeof(bool));
+
+        }
+
+        if(geometry)
+            memcpy(bottom_tiles[1].barrier, bottom_tiles[0].barrier, count * sizeof(bool));
+
+    }
+
+}
+
+
+
+
+/**
+ * Non-blocking counterparts of exchange_columns() and exchange() for the
+ * populations of l: remote peers get their persistent receive/send pair
+ * started and appended to requests. Ghost columns of peers on this node are
+ * copied right away, their rows are read in place through up_halo() and
+ * bottom_halo(). Return the request count.
+ */
+static int post_columns(lattice& l, MPI_Request* requests) {
+
+
+    int count = 0;
+
+
+    if(left_peer) {
+
+        if(left_peer.remote()) {
+
+            halo_start(&l.n[0][halo_left], MPI_TYPE_COLUMNS_LEFT, l.n[0], MPI_TYPE_COLUMNS_RIGHT, left_peer.rank, &requests[count]);
+            count += 2;
+
+        } else {
+
+            const auto prev = shared_units(left_peer, l);
+
+            for(size_t y = 0; y < LOCAL_HEIGHT; y++)
+                l.copy(XY(0, y, LOCAL_WIDTH), prev, XY(prev.width - 2 * halo_width, y, prev.width), halo_width);
+
+        }
+
+    }
+
+
+    if(right_peer) {
+
+        if(right_peer.remote()) {
+
+            halo_start(&l.n[0][LOCAL_WIDTH - 2 * halo_width], MPI_TYPE_COLUMNS_RIGHT, &l.n[0][LOCAL_WIDTH - halo_width], MPI_TYPE_COLUMNS_LEFT, right_peer.rank, &requests[count]);
+            count += 2;
+
+        } else {
+
+            const auto next = shared_units(right_peer, l);
+
+            for(size_t y = 0; y < LOCAL_HEIGHT; y++)
+                l.copy(XY(LOCAL_WIDTH - halo_width, y, LOCAL_WIDTH), next, XY(halo_width, y, next.width), halo_width);
+
+        }
+
+    }
+
+    return count;
+
+}
+
+
+static int post_rows(lattice& l, MPI_Request* requests) {
+
+
+    int count = 0;
+
+
+    if(up_peer && up_peer.remote()) {
+
+        halo_start(l.n[0], MPI_TYPE_ROW_UP, up_units.n[0], MPI_TYPE_FACE_DOWN, up_peer.rank, &requests[count]);
+        count += 2;
+
+    }
+
+
+    if(bottom_peer && bottom_peer.remote()) {
+
+        halo_start(&l.n[0][XY(0, LOCAL_HEIGHT - 1, LOCAL_WIDTH)], MPI_TYPE_ROW_DOWN, bottom_units.n[0], MPI_TYPE_FACE_UP, bottom_peer.rank, &requests[count]);
+        count += 2;
+
+    }
+
+    return count;
+
+}
+
+
+
+
+static void merge(lattice& dst, size_t k, const lattice& pushed, const lattice& src, size_t sk, int ey) {
+
+
+    for(auto i = 1; i < model::q; i++) {
+
+        if(model::e[i][1] != ey)
+            continue;
+
+        const int ex = model::e[i][0];
+
+        for(size_t x = ex > 0 ? 1 : 0; x < LOCAL_WIDTH - (ex < 0 ? 1 : 0); x++) {
+
+            if(src.barrier[sk + x - ex] || dst.barrier[k + x])
+                continue;
+
+            dst.n[i][k + x] = pushed.n[i][x];
+
+        }
+
+    }
+
+}
+
+
+void exchange_back() {
+
+
+    if(world_num_procs == 1)
+        return;
+
+
+
+    if(up_peer) {
+
+        if(up_peer.remote()) {
+
+            halo_sendrecv (
+                up_units.n[0], MPI_TYPE_HALO_UP,
+                up_units.n[0], MPI_TYPE_HALO_DOWN, up_peer.rank
+            );
+
+            merge(units, 0, up_units, up_units, 0, 1);
+
+        } else {
+
+            auto prev = shared_units(up_peer);
+
+            merge(prev, XY(0, prev.height - 1, LOCAL_WIDTH), up_units, units, 0, -1);
+
+        }
+
+    }
+
+
+    if(bottom_peer) {
+
+        if(bottom_peer.remote()) {
+
+            halo_sendrecv (
+                bottom_units.n[0], MPI_TYPE_HALO_DOWN,
+                bottom_units.n[0], MPI_TYPE_HALO_UP,   bottom_peer.rank
+            );
+
+            merge(units, XY(0, LOCAL_HEIGHT - 1, LOCAL_WIDTH), bottom_units, bottom_units, 0, -1);
+
+        } else {
+
+            auto next = shared_units(bottom_peer);
+
+            merge(next, 0, bottom_units, units, XY(0, LOCAL_HEIGHT - 1, LOCAL_WIDTH), 1);
+
+        }
+
+    }
+
+}
+
+
+
+
+/**
+ * Builds the type for the fields of l that cross a block face heading (ex, ey):
+ * the populations moving that way plus the velocity component the curl reads
+ * across it. field lays out the row or columns of a single field.
+ */
+static void face_type(int ex, int ey, const lattice& l, MPI_Datatype field, MPI_Datatype* type) {
+
+
+    MPI_Aint offsets[model::q];
+    int count = 0;
+
+    for(auto i = 1; i < model::q; i++) {
+
+        if((ex && model::e[i][0] == ex) || (ey && model::e[i][1] == ey))
+            offsets[count++] = (l.n[i] - l.n[0]) * sizeof(real);
+
+    }
+
+    offsets[count++] = ((ex ? l.uy : l.ux) - l.n[0]) * sizeof(real);
+
+    MPI_Type_create_hindexed_block(count, 1, offsets, field, type);
+    MPI_Type_commit(type);
+
+}
+
+
+/**
+ * The face types of a whole row of l, for the row sent up and the one sent
+ * down. The halo rows and the edge rows of a block are built from the same.
+ */
+static void row_types(const lattice& l, MPI_Datatype* up, MPI_Datatype* down) {
+
+
+    /* AA keeps the populations its next pass pulls in the opposite slots */
+    const int downward = engine == ENGINE_AA ? -1 : 1;
+
+    MPI_Datatype row;
+
+    MPI_Type_contiguous(l.width, mpi_scalar<real>::type(), &row);
+    face_type(0, -downward, l, row, up);
+    face_type(0,  downward, l, row, down);
+    MPI_Type_free(&row);
+
+}
+
+
+
+
+static void pushed_type(int ey, size_t stride, MPI_Datatype* type) {
+
+
+    int blocks[model::q];
+    int offsets[model::q];
+    int count = 0;
+
+    for(auto i = 1; i < model::q; i++) {
+
+        if(model::e[i][1] != ey)
+            continue;
+
+        blocks[count]  = LOCAL_WIDTH - abs(model::e[i][0]);
+        offsets[count] = i * stride + (model::e[i][0] > 0 ? 1 : 0);
+
+        count++;
+
+    }
+
+    MPI_Type_indexed(count, blocks, offsets, mpi_scalar<real>::type(), type);
+    MPI_Type_commit(type);
+
+}
+
+
+
+
+template<bool border>
+static inline void stream_collide(lattice& dst, const lattice& src, const lattice* rows[3], const size_t base[3], size_t x, size_t k, bool edge, const accum inlet[model::q]) {
+
+
+    if(src.barrier[k]) {
+
+        for(auto i = 0; i < model::q; i++)
+            dst.n[i][k] = 0.0;
+
+        dst.ux[k]  = 0.0;
+        dst.uy[k]  = 0.0;
+        dst.rho[k] = 0.0;
+
+        return;
+
+    }
+
+
+
+    accum f[model::q], u[model::d], rho;
+
+    if(edge) {
+
+        for(auto i = 0; i < model::q; i++)
+            f[i] = 0.0;
+
+        relax(f, src.velocity(k), 1.0, 1.0);
+
+    }
+
+
+    unroll<model::q>([&] (auto i) {
+
+        constexpr int ex = model::e[i][0];
+        constexpr int ey = model::e[i][1];
+
+        const lattice* row = rows[1 - ey];
+
+
+        if(border && (!row || x - ex < 0 || x - ex >= src.width)) {
+
+            if(!edge)
+                f[i] = src.n[i][k];
+
+            return;
+
+        }
+
+
+        const auto sk = base[1 - ey] + x - ex;
+
+        if(!edge)
+            f[i] = row->n[i][sk];
+
+        if(row->barrier[sk])
+            f[i] += src.n[model::opposite[i]][k];
+
+    });
+
+
+
+    moments(f, rho, u);
+    relax(f, u, flow_viscosity, rho);
+
+
+
+    if(border) {
+
+        unroll<model::q>([&] (auto i) {
+
+            constexpr int ex = model::e[i][0];
+
+            if((ex > 0 && x == 0) || (ex < 0 && x == src.width - 1))
+                f[i] = inlet[i];
+
+        });
+
+    }
+
+
+    for(auto i = 0; i < model::q; i++)
+        dst.n[i][k] = f[i];
+
+    dst.ux[k]  = u[0];
+    dst.uy[k]  = u[1];
+    dst.rho[k] = rho;
+
+}
+
+
+static void stream_collide(lattice& dst, const lattice& src, const lattice* rows[3], const size_t base[3], size_t y, size_t x0, size_t x1, bool edge, const accum inlet[model::q]) {
+
+
+    const auto w = src.width;
+
+
+    if(edge) {
+
+        for(auto x = x0; x < x1; x++)
+            stream_collide<true>(dst, src, rows, base, x, XY(x, y, w), edge, inlet);
+
+        return;
+
+    }
+
+
+    size_t x = x0;
+
+    if(x == 0)
+        stream_collide<true>(dst, src, rows, base, x++, XY(0, y, w), edge, inlet);
+
+
+    const auto end = std::min(x1, w - 1);
+
+    switch(simd) {
+
+        case SIMD_AVX512:
+            x = stream_collide_avx512(dst, src, rows, base, x, end, y, flow_viscosity);
+            break;
+
+        case SIMD_AVX2:
+            x = stream_collide_avx2(dst, src, rows, base, x, end, y, flow_viscosity);
+            break;
+
+    }
+
+    for(; x < end; x++)
+        stream_collide<false>(dst, src, rows, base, x, XY(x, y, w), false, inlet);
+
+
+    if(x1 == w)
+        stream_collide<true>(dst, src, rows, base, w - 1, XY(w - 1, y, w), edge, inlet);
+
+}
+
+
+static void stream_collide_rows(lattice& dst, const lattice& src, size_t first, size_t last, size_t x0, size_t x1, const accum inlet[model::q]) {
+
+
+    if(first >= last)
+        return;
+
+
+    const auto up     = up_halo(src);
+    const auto bottom = bottom_halo(src);
+
+
+    parallel([&] (int t) {
+
+        size_t begin, end;
+        partition(t, last - first, begin, end);
+
+        for(auto y = first + begin; y < first + end; y++) {
+
+
+            const bool edge = (!up_peer     && y == 0)
+                           || (!bottom_peer && y == LOCAL_HEIGHT - 1);
+
+
+            const lattice* rows[3] = {
+                y > 0                ? &src : (up_peer     ? &up     : nullptr),
+                                       &src,
+                y < LOCAL_HEIGHT - 1 ? &src : (bottom_peer ? &bottom : nullptr),
+            };
+
+            const size_t base[3] = {
+                y > 0                ? XY(0, y - 1, LOCAL_WIDTH) : 0,
+                                       XY(0, y,     LOCAL_WIDTH),
+                y < LOCAL_HEIGHT - 1 ? XY(0, y + 1, LOCAL_WIDTH) : 0,
+            };
+
+
+            stream_collide(dst, src, rows, base, y, x0, x1, edge, inlet);
+
+        }
+
+    });
+
+}
+
+
+void stream_collide(lattice& dst, const lattice& src) {
+
+
+    accum inlet[model::q];
+
+    inflow(inlet);
+
+
+    stream_collide_rows(dst, src, 0, LOCAL_HEIGHT, 0, LOCAL_WIDTH, inlet);
+
+}
+
+
+/**
+ * stream_collide() followed by exchange(), with the exchange hidden behind
+ * the interior. The rim the peers need is computed first, its halos are
+ * posted, and the interior rows run while the messages are in flight.
+ * Columns go before rows, so the rows carry fresh corner cells.
+ */
+void stream_collide_overlap(lattice& dst, const lattice& src) {
+
+
+    if(world_num_procs == 1)
+        return stream_collide(dst, src);
+
+
+
+    accum inlet[model::q];
+
+    inflow(inlet);
+
+
+    const size_t h = LOCAL_HEIGHT;
+
+    const size_t x0 = halo_left;
+    const size_t x1 = LOCAL_WIDTH - halo_right;
+
+    const size_t ix0 = x0 + (left_peer  ? 1 : 0);
+    const size_t ix1 = x1 - (right_peer ? 1 : 0);
+
+
+    stream_collide_rows(dst, src, 0, 1, x0, x1, inlet);
+
+    if(h > 1)
+        stream_collide_rows(dst, src, h - 1, h, x0, x1, inlet);
+
+    if(left_peer)
+        stream_collide_rows(dst, src, 1, h - 1, x0, ix0, inlet);
+
+    if(right_peer)
+        stream_collide_rows(dst, src, 1, h - 1, ix1, x1, inlet);
+
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+
+
+    MPI_Request requests[4];
+
+    size_t y = 1;
+
+    if(grid_width > 1) {
+
+        const auto count = post_columns(dst, requests);
+
+        y = std::max<size_t>(1, h / 2);
+        stream_collide_rows(dst, src, 1, y, ix0, ix1, inlet);
+
+        MPI_Waitall(count, requests, MPI_STATUSES_IGNORE);
+        MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+    }
+
+
+    const auto count = post_rows(dst, requests);
+
+    stream_collide_rows(dst, src, y, h - 1, ix0, ix1, inlet);
+
+    MPI_Waitall(count, requests, MPI_STATUSES_IGNORE);
+
+}
+
+
+
+
+/**
+ * Advances the slab by depth steps in one sweep. Rows run as a wavefront
+ * (level s lags level s - 1 by one row) inside column tiles that lean one
+ * column left per level, so each tile stays in cache across all levels.
+ * Halo rows received by exchange_tiles() are advanced too, shrinking by
+ * one row per level. Level s reads the buffers of parity s - 1 and writes
+ * the other ones, like step_ab().
+ *
+ * Tile j only reads columns of tile j - 1 that it has already finished,
+ * so threads take tiles round-robin and trail their left neighbour by one
+ * wavefront row.
+ */
+void stream_collide_tiled(int depth) {
+
+
+    accum inlet[model::q];
+
+    inflow(inlet);
+
+
+    const bool up   = bool(up_peer);
+    const bool down = bool(bottom_peer);
+
+    const int w = LOCAL_WIDTH;
+    const int h = LOCAL_HEIGHT;
+
+
+    const auto row = [&] (int v, int parity, size_t& y) -> lattice* {
+
+        if(v < 0) {
+
+            y = tile_depth + v;
+            return up ? &up_tiles[parity] : nullptr;
+
+        }
+
+        if(v >= h) {
+
+            y = v - h;
+            return down ? &bottom_tiles[parity] : nullptr;
+
+        }
+
+        y = v;
+        return parity ? &back_units : &units;
+
+    };
+
+
+    const int tiles = std::max(1, w / TILE_WIDTH);
+
+    std::unique_ptr<std::atomic<int>[]> progress(new std::atomic<int>[tiles]);
+
+    for(auto j = 0; j < tiles; j++)
+        progress[j] = up ? 1 - depth : 0;
+
+
+    parallel([&] (int t) {
+
+        for(auto j = t; j < tiles; j += num_threads) {
+
+            for(auto p = (up ? 1 - depth : 0); p < h + 2 * depth; p++) {
+
+
+                if(j > 0) {
+
+                    while(progress[j - 1].load(std::memory_order_acquire) <= p)
+                        std::this_thread::yield();
+
+                }
+
+
+                for(auto s = 1; s <= depth; s++) {
+
+
+                    const int v = p - (s - 1);
+
+                    if(v < (up ? s - depth : 0) || v >= (down ? h + depth - s : h))
+                        continue;
+
+
+                    const int x0 = std::max(0, j * TILE_WIDTH - (s - 1));
+                    const int x1 = j == tiles - 1 ? w : (j + 1) * TILE_WIDTH - (s - 1);
+
+                    if(x0 >= x1)
+                        continue;
+
+
+                    size_t y[3], ty;
+
+                    const lattice* rows[3] = {
+                        row(v - 1, (s - 1) & 1, y[0]),
+                        row(v,     (s - 1) & 1, y[1]),
+                        row(v + 1, (s - 1) & 1, y[2]),
+                    };
+
+                    const size_t base[3] = {
+                        rows[0] ? XY(0, y[0], w) : 0,
+                                  XY(0, y[1], w),
+                        rows[2] ? XY(0, y[2], w) : 0,
+                    };
+
+
+                    const bool edge = (!up && v == 0) || (!down && v == h - 1);
+
+                    stream_collide(*row(v, s & 1, ty), *rows[1], rows, base, y[1], x0, x1, edge, inlet);
+
+                }
+
+
+                progress[j].store(p + 1, std::memory_order_release);
+
+            }
+
+        }
+
+    });
+
+
+    if(depth & 1)
+        std::swap(units, back_units);
+
+}
+
+
+
+
+template<bool odd>
+static inline void stream_collide_aa(lattice& l, lattice* const rows[3], const size_t base[3], size_t x, size_t k, bool edge, const accum inlet[model::q]) {
+
+
+    if(l.barrier[k])
+        return;
+
+
+
+    accum f[model::q], u[model::d], rho;
+
+    if(edge) {
+
+        for(auto i = 0; i < model::q; i++)
+            f[i] = 0.0;
+
+        relax(f, l.velocity(k), 1.0, 1.0);
+
+    }
+
+
+    unroll<model::q>([&] (auto i) {
+
+        if(!odd && !edge) {
+
+            f[i] = l.n[i][k];
+            return;
+
+        }
+
+
+        constexpr int ex = model::e[i][0];
+        constexpr int ey = model::e[i][1];
+
+        const lattice* row = rows[1 - ey];
+
+
+        if(!row || x - ex < 0 || x - ex >= l.width) {
+
+            if(!edge)
+                f[i] = l.n[model::opposite[i]][k];
+
+            return;
+
+        }
+
+
+        const auto sk = base[1 - ey] + x - ex;
+
+        if(!edge)
+            f[i] = row->barrier[sk] ? 0.0 : row->n[model::opposite[i]][sk];
+
+        if(row->barrier[sk])
+            f[i] += l.n[i][k];
+
+    });
+
+
+
+    moments(f, rho, u);
+    relax(f, u, flow_viscosity, rho);
+
+
+
+    unroll<model::q>([&] (auto i) {
+
+        constexpr int ex = model::e[i][0];
+
+        if((ex > 0 && x == 0) || (ex < 0 && x == l.width - 1))
+            f[i] = inlet[i];
+
+    });
+
+
+
+    unroll<model::q>([&] (auto i) {
+
+        constexpr int o = model::opposite[i];
+
+        if(!odd) {
+
+            l.n[o][k] = f[i];
+            return;
+
+        }
+
+
+        constexpr int ex = model::e[i][0];
+        constexpr int ey = model::e[i][1];
+
+        lattice* row = rows[1 + ey];
+
+
+        if(!rows[1 - ey] || x - ex < 0 || x - ex >= l.width)
+            l.n[i][k] = f[i];
+
+        if(!row || x + ex < 0 || x + ex >= l.width)
+            return;
+
+
+        const auto tk = base[1 + ey] + x + ex;
+
+        if(row->barrier[tk])
+            l.n[o][k] = f[i];
+        else
+            row->n[i][tk] = f[i];
+
+    });
+
+    l.ux[k]  = u[0];
+    l.uy[k]  = u[1];
+    l.rho[k] = rho;
+
+}
+
+
+template<bool odd>
+void stream_collide_aa(bool prologue) {
+
+
+    accum inlet[model::q];
+
+    inflow(inlet);
+
+
+
+    for(auto pass = 0; pass < 2; pass++) {
+
+        parallel([&] (int t) {
+
+            size_t first, last;
+            partition(t, LOCAL_HEIGHT, first, last);
+
+            for(auto y = first; y < last; y++) {
+
+
+                const bool edge = !prologue && ((!up_peer     && y == 0)
+                                            ||  (!bottom_peer && y == LOCAL_HEIGHT - 1));
+
+
+                lattice* const rows[3] = {
+                    y > 0                ? &units : (up_peer     ? &up_units     : nullptr),
+                                           &units,
+                    y < LOCAL_HEIGHT - 1 ? &units : (bottom_peer ? &bottom_units : nullptr),
+                };
+
+                const size_t base[3] = {
+                    y > 0                ? XY(0, y - 1, LOCAL_WIDTH) : 0,
+                                           XY(0, y,     LOCAL_WIDTH),
+                    y < LOCAL_HEIGHT - 1 ? XY(0, y + 1, LOCAL_WIDTH) : 0,
+                };
+
+
+                if(pass == 0) {
+
+                    if(!edge) {
+
+                        stream_collide_aa<odd>(units, rows, base, 0, XY(0, y, LOCAL_WIDTH), edge, inlet);
+                        stream_collide_aa<odd>(units, rows, base, LOCAL_WIDTH - 1, XY(LOCAL_WIDTH - 1, y, LOCAL_WIDTH), edge, inlet);
+
+                    }
+
+                    continue;
+
+                }
+
+
+                if(edge) {
+
+                    for(size_t x = 0; x < LOCAL_WIDTH; x++)
+                        stream_collide_aa<odd>(units, rows, base, x, XY(x, y, LOCAL_WIDTH), edge, inlet);
+
+                    continue;
+
+                }
+
+
+                size_t x = 1;
+
+                switch(simd) {
+
+                    case SIMD_AVX512:
+                        x = odd ? stream_collide_aa_avx512(units, rows, base, x, LOCAL_WIDTH - 1, y, flow_viscosity)
+                                : collide_avx512(units, XY(x, y, LOCAL_WIDTH), XY(LOCAL_WIDTH - 1, y, LOCAL_WIDTH), true, flow_viscosity) - XY(0, y, LOCAL_WIDTH);
+                        break;
+
+                    case SIMD_AVX2:
+                        x = odd ? stream_collide_aa_avx2(units, rows, base, x, LOCAL_WIDTH - 1, y, flow_viscosity)
+                                : collide_avx2(units, XY(x, y, LOCAL_WIDTH), XY(LOCAL_WIDTH - 1, y, LOCAL_WIDTH), true, flow_viscosity) - XY(0, y, LOCAL_WIDTH);
+                        break;
+
+                }
+
+                for(; x < LOCAL_WIDTH - 1; x++)
+                    stream_collide_aa<odd>(units, rows, base, x, XY(x, y, LOCAL_WIDTH), false, inlet);
+
+            }
+
+        });
+
+    }
+
+}
+
+
+
+
+
+void step_inplace() {
+
+    collide();
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+    stream();
+    vorticity();
+    bounce();
+
+}
+
+
+void step_ab() {
+
+
+    const bool geometry = !units_primed;
+
+    if(!units_primed) {
+
+        collide();
+
+        units_primed = true;
+
+        MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+        exchange(geometry);
+
+    } else {
+
+        stream_collide_overlap(back_units, units);
+
+        std::swap(units, back_units);
+
+    }
+
+
+    vorticity_halo();
+
+}
+
+
+void step_aa() {
+
+
+    const bool geometry = !units_primed;
+
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+    if(!units_primed) {
+
+        stream_collide_aa<false>(true);
+
+        units_primed  = true;
+        units_swapped = true;
+
+    } else {
+
+        if(units_swapped)
+            stream_collide_aa<true>(false);
+        else
+            stream_collide_aa<false>(false);
+
+        units_swapped = !units_swapped;
+
+    }
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+
+    if(!units_swapped) {
+
+        exchange_back();
+
+        MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+    }
+
+    exchange(geometry);
+
+    vorticity_halo();
+
+}
+
+
+
+
+
+void step_tiled(int depth) {
+
+
+    const bool geometry = !units_primed;
+
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+    if(!units_primed) {
+
+        collide();
+
+        units_primed = true;
+
+    } else {
+
+        stream_collide_tiled(depth);
+
+    }
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+
+    exchange(geometry);
+    exchange_tiles(geometry);
+
+    vorticity_halo();
+
+}
+
+
+
+
+
+/**
+ * Maps a value onto the 0..1024 scale of the colormap, as redraw() draws it.
+ */
+static inline uint16_t shade(double value) {
+    return std::min(std::max((int) (1024 * (value * 4 + 0.5)), 0), 1024);
+}
+
+
+/**
+ * Shades count cells of l from k on for mode, one mode per loop so that the
+ * loops stay simple enough for the compiler to vectorize.
+ */
+static void shade_row(uint16_t* out, const lattice& l, size_t k, size_t count, int mode) {
+
+    switch(mode) {
+
+        case 0:
+
+            for(size_t x = 0; x < count; x++)
+                out[x] = shade(l.curl[k + x]);
+
+            break;
+
+        case 1:
+
+            for(size_t x = 0; x < count; x++)
+                out[x] = shade(l.new_rho(k + x) / 16.0);
+
+            break;
+
+        case 2:
+
+            for(size_t x = 0; x < count; x++)
+                out[x] = shade(l.velocity(k + x).len());
+
+            break;
+
+        case 3:
+
+            for(size_t x = 0; x < count; x++)
+                out[x] = shade(l.ux[k + x]);
+
+            break;
+
+        case 4:
+
+            for(size_t x = 0; x < count; x++)
+                out[x] = shade(l.uy[k + x]);
+
+            break;
+
+    }
+
+}
+
+
+
+/**
+ * The rank whose block holds viewport cell (x, y).
+ */
+static int cell_owner(size_t x, size_t y) {
+
+    int c[2] = {
+        (int) (std::upper_bound(row_offsets.begin(),    row_offsets.end(),    y) - row_offsets.begin())    - 1,
+        (int) (std::upper_bound(column_offsets.begin(), column_offsets.end(), x) - column_offsets.begin()) - 1
+    };
+
+    int rank;
+    MPI_Cart_rank(MPI_COMM_GRID, c, &rank);
+
+    return rank;
+
+}
+
+
+
+/**
+ * Frames are only gathered when the primary asks for one, and only as the
+ * 16-bit shades of the field draw_mode selects, which each rank computes
+ * for its own block. MPI_Igatherv() carries them to shades while the next
+ * steps run; once it completes, the primary unpacks them into the frame
+ * buffer it is filling and publishes that to the render thread.
+ */
+static MPI_Request gather_requests[3] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+static bool gather_pending = false;
+static uint8_t gather_mode = 0;
+
+/* The cell under the cursor travels with the frame, exactly, from its owner */
+static int64_t gather_probe = -1;
+static double probe_sent[4];
+static double probe_received[4];
+
+
+static void unpack_frame() {
+
+
+    auto& buffer = frames[frame_filling];
+
+    buffer.mode    = gather_mode;
+    buffer.probe   = gather_probe;
+    buffer.regions = regions;
+
+    memcpy(buffer.probed, probe_received, sizeof(buffer.probed));
+    buffer.rows    = row_offsets;
+
+
+    for(auto i = 0; i < world_num_procs; i++) {
+
+        const auto& r = regions[i];
+        const auto* src = &shades[frame_offsets[i]];
+
+        for(size_t y = 0; y < r.height; y++)
+            memcpy(&buffer.shades[XY(r.x, r.y + y, viewport_width)], &src[y * r.width], r.width * sizeof(uint16_t));
+
+    }
+
+
+    frame_filling  = frame_middle.exchange(frame_filling | FRAME_FRESH) & ~FRAME_FRESH;
+    gather_pending = false;
+
+}
+
+
+#if !defined(HEADLESS)
+
+/**
+ * Takes the latest published frame buffer for frame_showing, if there is one.
+ * False until the first gathered frame has arrived, when frame_showing still
+ * holds no shades, regions or rows to draw.
+ */
+static bool frame_acquire() {
+
+    static bool acquired = false;
+
+    if(frame_middle.load() & FRAME_FRESH) {
+
+        frame_showing = frame_middle.exchange(frame_showing) & ~FRAME_FRESH;
+        acquired = true;
+
+    }
+
+    return acquired;
+
+}
+
+#endif
+
+
+static void gather_wait() {
+
+    MPI_Waitall(3, gather_requests, MPI_STATUSES_IGNORE);
+
+    if(gather_pending)
+        unpack_frame();
+
+}
+
+
+static void gather_start() {
+
+
+    gather_wait();
+
+
+    parallel([] (int t) {
+
+        size_t first, last;
+        partition(t, block_height, first, last);
+
+        for(auto y = first; y < last; y++)
+            shade_row(&block_shades[XY(0, y, block_width)], units, XY(halo_left, y, unit_width), block_width, draw_mode);
+
+    });
+
+
+    MPI_Igatherv(block_shades.data(), block_shades.size(), MPI_UINT16_T, shades.data(), frame_counts.data(), frame_offsets.data(), MPI_UINT16_T, PRIMARY, MPI_COMM_WORLD, &gather_requests[0]);
+
+
+    if(probe >= 0) {
+
+        const size_t x = probe % viewport_width;
+        const size_t y = probe / viewport_width;
+
+        const int owner = cell_owner(x, y);
+
+        if(world_rank == owner) {
+
+            const auto& r = regions[world_rank];
+            const auto k = XY(halo_left + x - r.x, y - r.y, unit_width);
+
+            probe_sent[0] = units.new_rho(k);
+            probe_sent[1] = units.ux[k];
+            probe_sent[2] = units.uy[k];
+            probe_sent[3] = units.curl[k];
+
+            MPI_Isend(probe_sent, 4, MPI_DOUBLE, PRIMARY, 3, MPI_COMM_WORLD, &gather_requests[1]);
+
+        }
+
+        if(world_rank == PRIMARY)
+            MPI_Irecv(probe_received, 4, MPI_DOUBLE, owner, 3, MPI_COMM_WORLD, &gather_requests[2]);
+
+    }
+
+
+    gather_pending = world_rank == PRIMARY;
+    gather_mode    = draw_mode;
+    gather_probe   = probe;
+
+}
+
+
+static void gather_progress() {
+
+    int done;
+
+    MPI_Testall(3, gather_requests, &done, MPI_STATUSES_IGNORE);
+
+    if(gather_pending && done)
+        unpack_frame();
+
+}
+
+
+#if defined(BENCH)
+
+/**
+ * Gathers every field of every block into frame and waits for it. Only the
+ * end of a BENCH run needs whole fields, to dump them.
+ */
+static void gather_fields() {
+
+
+    parallel([] (int t) {
+
+        size_t first, last;
+        partition(t, block_height, first, last);
+
+        for(auto y = first; y < last; y++)
+            snapshot.copy(XY(0, y, block_width), units, XY(halo_left, y, unit_width), block_width);
+
+    });
+
+
+    std::vector<int> counts(world_num_procs);
+    std::vector<int> offsets(world_num_procs);
+    std::vector<real> staging;
+
+    for(auto i = 0; i < world_num_procs; i++) {
+
+        counts[i]  = frame_counts[i]  * LATTICE_FIELDS;
+        offsets[i] = frame_offsets[i] * LATTICE_FIELDS;
+
+    }
+
+    if(world_rank == PRIMARY)
+        staging.resize(viewport_width * viewport_height * LATTICE_FIELDS);
+
+
+    MPI_Gatherv(snapshot.n[0], 1, MPI_TYPE_SNAPSHOT, staging.data(), counts.data(), offsets.data(), mpi_scalar<real>::type(), PRIMARY, MPI_COMM_WORLD);
+
+
+    if(world_rank != PRIMARY)
+        return;
+
+    for(auto i = 0; i < world_num_procs; i++) {
+
+        const auto& r = regions[i];
+        const auto* src = &staging[offsets[i]];
+
+        for(auto f = 0; f < LATTICE_FIELDS; f++) {
+
+            for(size_t y = 0; y < r.height; y++)
+                memcpy(&frame.n[0][f * frame.stride + XY(r.x, r.y + y, viewport_width)], &src[(f * r.height + y) * r.width], r.width * sizeof(real));
+
+        }
+
+    }
+
+}
+
+
+
+
+
+#endif
+
+
+#if defined(HEADLESS)
+
+/**
+ * Writes ux, uy, rho and curl of the whole viewport to path, one plane of
+ * doubles after the other as BENCH_DUMP lays them out. Every rank writes its
+ * own block in place with a single collective call, so the fields never
+ * pass through the primary however large the viewport is.
+ */
+static void write_fields(const std::string& path) {
+
+
+    std::vector<double> values(4 * block_width * block_height);
+
+    parallel([&] (int t) {
+
+        size_t first, last;
+        partition(t, block_height, first, last);
+
+        for(auto y = first; y < last; y++) {
+
+            const auto k = XY(halo_left, y, unit_width);
+
+            size_t f = 0;
+
+            for(const auto* field : { units.ux, units.uy, units.rho, units.curl }) {
+
+                auto* dst = &values[XY(0, f++ * block_height + y, block_width)];
+
+                for(size_t x = 0; x < block_width; x++)
+                    dst[x] = field[k + x];
+
+            }
+
+        }
+
+    });
+
+
+    const auto& r = regions[world_rank];
+
+    int sizes[2]    = { (int) viewport_height, (int) viewport_width };
+    int subsizes[2] = { (int) block_height,    (int) block_width    };
+    int starts[2]   = { (int) r.y,             (int) r.x            };
+
+    const MPI_Offset plane = viewport_width * viewport_height * sizeof(double);
+
+    MPI_Datatype block;
+    MPI_Datatype blocks;
+
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &block);
+    MPI_Type_create_hvector(4, 1, plane, block, &blocks);
+    MPI_Type_commit(&blocks);
+    MPI_Type_free(&block);
+
+
+    MPI_File file;
+
+    if(MPI_File_open(MPI_COMM_WORLD, path.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+    MPI_File_set_size(file, 4 * plane);
+    MPI_File_set_view(file, 0, MPI_DOUBLE, blocks, "native", MPI_INFO_NULL);
+
+    if(MPI_File_write_all(file, values.data(), values.size(), MPI_DOUBLE, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+    MPI_File_close(&file);
+    MPI_Type_free(&blocks);
+
+}
+
+#endif
+
+
+
+
+
+/**
+ * The UI's requests travel in a single packed MPI_Ibcast that is started every
+ * CONTROL_INTERVAL iterations and completed one interval later, so its latency
+ * hides behind the steps in between and every rank applies it on the same
+ * iteration. Messages whose epoch was already applied are skipped.
+ */
+static control message = requested;
+static MPI_Request control_request = MPI_REQUEST_NULL;
+static uint32_t control_epoch = 0;
+
+static std::vector<uint32_t> message_edits;
+
+
+/**
+ * Refreshes every halo, barriers included, after this rank's block changed
+ * outside a step. Unprimed blocks get theirs from the next step anyway.
+ */
+static void refresh_halos() {
+
+    if(!units_primed || engine == ENGINE_INPLACE)
+        return;
+
+    exchange(true);
+
+    if(engine == ENGINE_TILED)
+        exchange_tiles(true);
+
+}
+
+
+/**
+ * Turns the barrier cells of a control message solid without a reset. The
+ * primary sorts them by owner and scatters them, and each owner empties its
+ * cells the way a reset leaves solid ones, so the cost is in the edited
+ * cells and the halos rather than in the whole viewport.
+ */
+static void apply_edits(const std::vector<uint32_t>& edits) {
+
+
+    std::vector<int> counts(world_num_procs, 0);
+    std::vector<int> offsets(world_num_procs, 0);
+    std::vector<uint32_t> sorted(edits.size());
+
+    if(world_rank == PRIMARY) {
+
+        std::vector<int> owners(edits.size());
+
+        for(size_t i = 0; i < edits.size(); i++) {
+
+            owners[i] = cell_owner(edits[i] % viewport_width, edits[i] / viewport_width);
+
+            counts[owners[i]]++;
+
+        }
+
+        for(auto i = 1; i < world_num_procs; i++)
+            offsets[i] = offsets[i - 1] + counts[i - 1];
+
+
+        auto next = offsets;
+
+        for(size_t i = 0; i < edits.size(); i++)
+            sorted[next[owners[i]]++] = edits[i];
+
+    }
+
+
+    int count;
+
+    MPI_Scatter(counts.data(), 1, MPI_INT, &count, 1, MPI_INT, PRIMARY, MPI_COMM_WORLD);
+
+    std::vector<uint32_t> cells(count);
+
+    MPI_Scatterv(sorted.data(), counts.data(), offsets.data(), MPI_UINT32_T, cells.data(), count, MPI_UINT32_T, PRIMARY, MPI_COMM_WORLD);
+
+
+
+    const auto solidify = [] (lattice& l, size_t k) {
+
+        l.barrier[k] = true;
+        l.zero(k);
+        l.ux[k] = 0.0;
+        l.uy[k] = 0.0;
+
+    };
+
+    const auto& r = regions[world_rank];
+
+    for(const auto cell : cells) {
+
+        const auto k = XY(halo_left + cell % viewport_width - r.x, cell / viewport_width - r.y, unit_width);
+
+        solidify(units, k);
+
+        if(engine == ENGINE_AB || engine == ENGINE_TILED)
+            solidify(back_units, k);
+
+    }
+
+    if(count > 0)
+        compile_geometry();
+
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+    refresh_halos();
+
+}
+
+
+static void control_exchange() {
+
+
+    MPI_Wait(&control_request, MPI_STATUS_IGNORE);
+
+
+    if(message.epoch != control_epoch) {
+
+        control_epoch  = message.epoch;
+
+        running        = message.running;
+        paused         = message.paused;
+        resetting     |= message.resetting;
+        gathering     |= message.gathering;
+        draw_mode      = message.draw_mode;
+        probe          = message.probe;
+        flow_viscosity = message.viscosity;
+        flow_speed     = message.speed;
+
+        /* A reset rebuilds the edited cells anyway */
+        if(message.edits > 0 && !message.resetting)
+            apply_edits(message_edits);
+
+        message_edits.clear();
+
+    }
+
+
+    if(world_rank == PRIMARY) {
+
+        std::lock_guard<std::mutex> guard(ui_lock);
+
+        const bool changed = requested.resetting
+                          || requested.gathering
+                          || !barrier_edits.empty()
+                          || requested.running   != message.running
+                          || requested.paused    != message.paused
+                          || requested.draw_mode != message.draw_mode
+                          || requested.probe     != message.probe
+                          || requested.viscosity != message.viscosity
+                          || requested.speed.x() != message.speed.x()
+                          || requested.speed.y() != message.speed.y();
+
+        if(changed) {
+
+            message       = requested;
+            message.epoch = control_epoch + 1;
+            message.edits = barrier_edits.size();
+
+            message_edits.swap(barrier_edits);
+            barrier_edits.clear();
+
+            requested.resetting = false;
+            requested.gathering = false;
+
+        }
+
+    }
+
+
+    MPI_Ibcast(&message, sizeof(message), MPI_BYTE, PRIMARY, MPI_COMM_WORLD, &control_request);
+
+}
+
+
+
+
+
+#if defined(HEADLESS)
+
+/**
+ * Checkpoints hold the whole state of a run in a single file: a header, then
+ * every lattice field of the viewport as a plane of reals, then the barrier
+ * as a plane of bytes. The layout does not depend on the decomposition, so
+ * a run can be restarted on any number of ranks, each reading back the rows
+ * it owns. A checkpoint is written to path.part with a nonblocking collective
+ * write while the solver keeps stepping, and renamed to path once every
+ * rank's share has drained.
+ */
+struct checkpoint_header {
+
+    char magic[8];
+    uint32_t version;
+    uint32_t engine;
+    uint32_t real_size;
+    uint32_t fields;
+
+    uint64_t width;
+    uint64_t height;
+    uint64_t iterations;
+
+    double viscosity;
+    double speed[2];
+
+    uint8_t primed;
+    uint8_t swapped;
+
+};
+
+#define CHECKPOINT_MAGIC            "WINDCKPT"
+#define CHECKPOINT_VERSION          1
+
+static MPI_File checkpoint_file;
+static MPI_Request checkpoint_request = MPI_REQUEST_NULL;
+static std::vector<uint8_t> checkpoint_staging;
+static std::string checkpoint_path;
+static bool checkpoint_pending = false;
+
+
+/**
+ * The file layout of columns [x, x + width) of this rank's rows, past the
+ * header. Its elements are bytes, the etype of every checkpoint view.
+ */
+static MPI_Datatype checkpoint_type(size_t x, size_t width) {
+
+
+    const auto& r = regions[world_rank];
+
+    int sizes[2]    = { (int) viewport_height, (int) viewport_width };
+    int subsizes[2] = { (int) block_height,    (int) width          };
+    int starts[2]   = { (int) r.y,             (int) x              };
+
+    const MPI_Aint plane = viewport_width * viewport_height;
+
+
+    MPI_Datatype scalar;
+    MPI_Datatype field;
+    MPI_Datatype fields;
+    MPI_Datatype barrier;
+    MPI_Datatype type;
+
+    MPI_Type_contiguous(sizeof(real), MPI_BYTE, &scalar);
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, scalar, &field);
+    MPI_Type_create_hvector(LATTICE_FIELDS, 1, plane * sizeof(real), field, &fields);
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_BYTE, &barrier);
+
+    MPI_Datatype types[] = { fields, barrier };
+    MPI_Aint offsets[]   = { 0, (MPI_Aint) (LATTICE_FIELDS * plane * sizeof(real)) };
+    int blocks[]         = { 1, 1 };
+
+    MPI_Type_create_struct(2, blocks, offsets, types, &type);
+    MPI_Type_commit(&type);
+
+
+    for(auto* t : { &scalar, &field, &fields, &barrier })
+        MPI_Type_free(t);
+
+    return type;
+
+}
+
+
+/**
+ * Waits for the pending checkpoint, if any, and puts it in place.
+ */
+static void checkpoint_finish() {
+
+
+    if(!checkpoint_pending)
+        return;
+
+
+    MPI_Wait(&checkpoint_request, MPI_STATUS_IGNORE);
+
+    MPI_File_sync(checkpoint_file);
+    MPI_File_close(&checkpoint_file);
+
+
+    if(world_rank == PRIMARY) {
+
+        if(rename((checkpoint_path + ".part").c_str(), checkpoint_path.c_str()) != 0)
+            MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+    }
+
+    checkpoint_pending = false;
+
+}
+
+
+static void checkpoint_start(uint64_t iterations) {
+
+
+    checkpoint_finish();
+
+
+    const size_t cells = block_width * block_height;
+
+    checkpoint_staging.resize(cells * (LATTICE_FIELDS * sizeof(real) + sizeof(bool)));
+
+    auto* fields  = (real*) checkpoint_staging.data();
+    auto* barrier = (bool*) &fields[LATTICE_FIELDS * cells];
+
+    parallel([&] (int t) {
+
+        size_t first, last;
+        partition(t, block_height, first, last);
+
+        for(auto y = first; y < last; y++) {
+
+            const auto k = XY(halo_left, y, unit_width);
+
+            for(auto f = 0; f < LATTICE_FIELDS; f++)
+                memcpy(&fields[f * cells + XY(0, y, block_width)], &units.n[0][f * units.stride + k], block_width * sizeof(real));
+
+            memcpy(&barrier[XY(0, y, block_width)], &units.barrier[k], block_width * sizeof(bool));
+
+        }
+
+    });
+
+
+    if(MPI_File_open(MPI_COMM_WORLD, (checkpoint_path + ".part").c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &checkpoint_file) != MPI_SUCCESS)
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+
+    checkpoint_header header = { };
+
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+
+    header.version    = CHECKPOINT_VERSION;
+    header.engine     = engine;
+    header.real_size  = sizeof(real);
+    header.fields     = LATTICE_FIELDS;
+    header.width      = viewport_width;
+    header.height     = viewport_height;
+    header.iterations = iterations;
+    header.viscosity  = flow_viscosity;
+    header.speed[0]   = flow_speed.x();
+    header.speed[1]   = flow_speed.y();
+    header.primed     = units_primed;
+    header.swapped    = units_swapped;
+
+    if(world_rank == PRIMARY)
+        MPI_File_write_at(checkpoint_file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+
+
+    auto type = checkpoint_type(regions[world_rank].x, block_width);
+
+    MPI_Datatype cell;
+    MPI_Type_contiguous(cells, MPI_BYTE, &cell);
+    MPI_Type_commit(&cell);
+
+    MPI_File_set_size(checkpoint_file, sizeof(header) + viewport_width * viewport_height * (LATTICE_FIELDS * sizeof(real) + sizeof(bool)));
+    MPI_File_set_view(checkpoint_file, sizeof(header), MPI_BYTE, type, "native", MPI_INFO_NULL);
+    MPI_File_iwrite_at_all(checkpoint_file, 0, checkpoint_staging.data(), LATTICE_FIELDS * sizeof(real) + sizeof(bool), cell, &checkpoint_request);
+
+    MPI_Type_free(&cell);
+    MPI_Type_free(&type);
+
+
+    checkpoint_pending = true;
+
+}
+
+
+/**
+ * Lets the pending checkpoint drain. Ranks only agree that it is done every
+ * CONTROL_INTERVAL ticks, the same ticks everywhere, since closing the file
+ * is collective.
+ */
+static void checkpoint_progress(size_t ticks) {
+
+
+    if(!checkpoint_pending)
+        return;
+
+
+    int done;
+
+    if(checkpoint_request != MPI_REQUEST_NULL)
+        MPI_Test(&checkpoint_request, &done, MPI_STATUS_IGNORE);
+
+    if(ticks % CONTROL_INTERVAL != 0)
+        return;
+
+
+    done = checkpoint_request == MPI_REQUEST_NULL;
+
+    MPI_Allreduce(MPI_IN_PLACE, &done, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+
+    if(done)
+        checkpoint_finish();
+
+}
+
+
+/**
+ * Reads the header of the checkpoint at path on every rank.
+ */
+static bool checkpoint_read_header(const std::string& path, checkpoint_header& header) {
+
+
+    MPI_File file;
+
+    if(MPI_File_open(MPI_COMM_WORLD, path.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        return false;
+
+    MPI_File_read_at_all(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+
+
+    return memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0
+        && header.version   == CHECKPOINT_VERSION
+        && header.real_size == sizeof(real)
+        && header.fields    == LATTICE_FIELDS
+        && header.engine    == (uint32_t) engine;
+
+}
+
+
+/**
+ * Reads this rank's rows of the checkpoint at path into units, ghost columns
+ * included, and brings the engine back to the state it was saved in.
+ */
+static void checkpoint_restore(const std::string& path, const checkpoint_header& header) {
+
+
+    MPI_File file;
+
+    if(MPI_File_open(MPI_COMM_WORLD, path.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+
+    const size_t cells = unit_width * block_height;
+
+    std::vector<uint8_t> staging(cells * (LATTICE_FIELDS * sizeof(real) + sizeof(bool)));
+
+    auto type = checkpoint_type(regions[world_rank].x - halo_left, unit_width);
+
+    MPI_Datatype cell;
+    MPI_Type_contiguous(cells, MPI_BYTE, &cell);
+    MPI_Type_commit(&cell);
+
+    MPI_File_set_view(file, sizeof(header), MPI_BYTE, type, "native", MPI_INFO_NULL);
+    MPI_File_read_at_all(file, 0, staging.data(), LATTICE_FIELDS * sizeof(real) + sizeof(bool), cell, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+
+    MPI_Type_free(&cell);
+    MPI_Type_free(&type);
+
+
+    const auto* fields  = (const real*) staging.data();
+    const auto* barrier = (const bool*) &fields[LATTICE_FIELDS * cells];
+
+    for(auto f = 0; f < LATTICE_FIELDS; f++)
+        memcpy(&units.n[0][f * units.stride], &fields[f * cells], cells * sizeof(real));
+
+    memcpy(units.barrier, barrier, cells * sizeof(bool));
+
+
+    if(engine == ENGINE_AB || engine == ENGINE_TILED) {
+
+        back_units.copy(0, units, 0, unit_size);
+        memcpy(back_units.barrier, units.barrier, unit_size * sizeof(bool));
+
+    }
+
+    units_primed  = header.primed;
+    units_swapped = header.swapped;
+
+    compile_geometry();
+
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+    refresh_halos();
+
+}
+
+#endif
+
+
+
+
+
+/**
+ * Moves the rows this rank held under previous_offsets to the ranks of its
+ * grid column that own them under row_offsets. Rows keep their ghost
+ * columns, which hold the same cells whichever rank the row lives on.
+ */
+static void migrate(const lattice& previous, const std::vector<size_t>& previous_offsets) {
+
+
+    std::vector<MPI_Request> requests;
+    std::vector<MPI_Datatype> types;
+
+    const auto rows = [&] (size_t stride, size_t count) {
+
+        MPI_Datatype type;
+
+        MPI_Type_vector(LATTICE_FIELDS, count * unit_width, stride, mpi_scalar<real>::type(), &type);
+        MPI_Type_commit(&type);
+
+        types.push_back(type);
+
+        return type;
+
+    };
+
+
+    const auto held  = previous_offsets[grid_row];
+    const auto owned = row_offsets[grid_row];
+
+    for(auto r = 0; r < grid_height; r++) {
+
+
+        int c[2] = { r, grid_column };
+        int rank;
+
+        MPI_Cart_rank(MPI_COMM_GRID, c, &rank);
+
+
+        /* Rows this rank held that r owns now, and rows r held that this rank owns now */
+        const auto send_first = std::max(held,  row_offsets[r]);
+        const auto send_last  = std::min(previous_offsets[grid_row + 1], row_offsets[r + 1]);
+        const auto recv_first = std::max(owned, previous_offsets[r]);
+        const auto recv_last  = std::min(row_offsets[grid_row + 1], previous_offsets[r + 1]);
+
+
+        if(r == grid_row) {
+
+            for(auto y = send_first; y < send_last; y++) {
+
+                units.copy(XY(0, y - owned, unit_width), previous, XY(0, y - held, unit_width), unit_width);
+                memcpy(&units.barrier[XY(0, y - owned, unit_width)], &previous.barrier[XY(0, y - held, unit_width)], unit_width * sizeof(bool));
+
+            }
+
+            continue;
+
+        }
+
+
+        if(send_first < send_last) {
+
+            const auto count = send_last - send_first;
+            const auto k     = XY(0, send_first - held, unit_width);
+
+            requests.resize(requests.size() + 2);
+
+            MPI_Isend(&previous.n[0][k],    1, rows(previous.stride, count), rank, 1, MPI_COMM_WORLD, &requests.end()[-2]);
+            MPI_Isend(&previous.barrier[k], count * unit_width, MPI_CXX_BOOL, rank, 2, MPI_COMM_WORLD, &requests.end()[-1]);
+
+        }
+
+        if(recv_first < recv_last) {
+
+            const auto count = recv_last - recv_first;
+            const auto k     = XY(0, recv_first - owned, unit_width);
+
+            requests.resize(requests.size() + 2);
+
+            MPI_Irecv(&units.n[0][k],    1, rows(units.stride, count), rank, 1, MPI_COMM_WORLD, &requests.end()[-2]);
+            MPI_Irecv(&units.barrier[k], count * unit_width, MPI_CXX_BOOL, rank, 2, MPI_COMM_WORLD, &requests.end()[-1]);
+
+        }
+
+    }
+
+
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+
+    for(auto& type : types)
+        MPI_Type_free(&type);
+
+}
+
+
+
+/**
+ * Splits the rows of the grid at row_offsets. Everything sized by the block
+ * height is rebuilt: the shared window, the row and column datatypes, the
+ * snapshot and every rank's region of the frame. With migrate, the state of
+ * the old blocks moves into the new ones and the simulation carries on.
+ */
+static void decompose(const std::vector<size_t>& offsets, bool migrate_units) {
+
+
+    const bool rebuild = units_data != nullptr;
+
+    const auto previous_offsets = row_offsets;
+    const auto previous = units;
+
+    MPI_Win previous_window = MPI_LOCAL_WINDOW;
+
+
+    gather_wait();
+
+    halo_release();
+
+
+    row_offsets = offsets;
+
+    block_height = row_offsets[grid_row + 1] - row_offsets[grid_row];
+
+    unit_height = block_height;
+    unit_size   = unit_width * unit_height;
+
+
+    up_peer.height     = up_peer     ? row_offsets[grid_row] - row_offsets[grid_row - 1]     : 0;
+    bottom_peer.height = bottom_peer ? row_offsets[grid_row + 2] - row_offsets[grid_row + 1] : 0;
+    left_peer.height   = block_height;
+    right_peer.height  = block_height;
+
+
+
+    regions.resize(world_num_procs);
+    frame_counts.resize(world_num_procs);
+    frame_offsets.resize(world_num_procs);
+
+    size_t total = 0;
+
+    for(auto i = 0; i < world_num_procs; i++) {
+
+        int c[2];
+        MPI_Cart_coords(MPI_COMM_GRID, i, 2, c);
+
+        regions[i] = {
+            column_offsets[c[1]],
+            row_offsets[c[0]],
+            column_offsets[c[1] + 1] - column_offsets[c[1]],
+            row_offsets[c[0] + 1] - row_offsets[c[0]]
+        };
+
+        frame_counts[i]  = regions[i].width * regions[i].height;
+        frame_offsets[i] = total;
+
+        total += frame_counts[i];
+
+    }
+
+#if !defined(HEADLESS)
+
+    if(world_rank == PRIMARY)
+        shades.resize(total);
+
+#endif
+
+
+
+    units_segment = lattice::bytes(unit_width, unit_height) * (engine == ENGINE_AB || engine == ENGINE_TILED ? 2 : 1);
+
+
+    MPI_Info window_info;
+
+    MPI_Info_create(&window_info);
+    MPI_Info_set(window_info, "alloc_shared_noncontig", "true");
+
+    if(MPI_Win_allocate_shared (units_segment, sizeof(real), window_info, MPI_COMM_LOCAL, &units_data, &MPI_LOCAL_WINDOW) != MPI_SUCCESS)
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+    MPI_Info_free(&window_info);
+
+
+    for(auto* p : { &up_peer, &bottom_peer, &left_peer, &right_peer }) {
+
+        if(!*p || p->remote())
+            continue;
+
+        MPI_Aint size;
+        int disp;
+
+        MPI_Win_shared_query(MPI_LOCAL_WINDOW, p->local, &size, &disp, &p->segment);
+
+    }
+
+    units.bind(units_data, unit_width, unit_height);
+    first_touch(units);
+
+    if(engine == ENGINE_AB || engine == ENGINE_TILED) {
+
+        back_units.bind((void*) ((uintptr_t) units_data + units_segment / 2), unit_width, unit_height);
+        first_touch(back_units);
+
+    }
+
+
+
+    if(migrate_units) {
+
+        migrate(previous, previous_offsets);
+
+        if(engine == ENGINE_AB || engine == ENGINE_TILED) {
+
+            back_units.copy(0, units, 0, unit_size);
+            memcpy(back_units.barrier, units.barrier, unit_size * sizeof(bool));
+
+        }
+
+    }
+
+    if(rebuild)
+        MPI_Win_free(&previous_window);
+
+    MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+
+
+
+    if(rebuild) {
+
+#if defined(BENCH)
+
+        free(snapshot.n[0]);
+
+        MPI_Type_free(&MPI_TYPE_SNAPSHOT);
+
+#endif
+
+        MPI_Type_free(&MPI_TYPE_ROW_UP);
+        MPI_Type_free(&MPI_TYPE_ROW_DOWN);
+
+        if(grid_width > 1) {
+
+            if(MPI_TYPE_COLUMNS_RIGHT != MPI_TYPE_COLUMNS_LEFT)
+                MPI_Type_free(&MPI_TYPE_COLUMNS_RIGHT);
+
+            MPI_Type_free(&MPI_TYPE_COLUMNS_LEFT);
+            MPI_Type_free(&MPI_TYPE_COLUMNS_BARRIER);
+
+        }
+
+        if(engine == ENGINE_TILED)
+            MPI_Type_free(&MPI_TYPE_TILE);
+
+    }
+
+
+#if defined(BENCH)
+
+    /* Only the final dump of a BENCH run reads whole fields */
+    if(!lattice_alloc(snapshot, block_width, block_height))
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+    MPI_Type_vector(LATTICE_FIELDS, snapshot.size, snapshot.stride, mpi_scalar<real>::type(), &MPI_TYPE_SNAPSHOT);
+    MPI_Type_commit(&MPI_TYPE_SNAPSHOT);
+
+#endif
+
+#if !defined(HEADLESS)
+
+    block_shades.resize(block_width * block_height);
+
+#endif
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_P)
-                paused = !paused;
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_I)
-                draw_groups = !draw_groups;
-            
-            else if(e->keyboard.keycode == ALLEGRO_KEY_U)
-                draw_nodes = !draw_nodes;
 
+    row_types(units, &MPI_TYPE_ROW_UP, &MPI_TYPE_ROW_DOWN);
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_7)
-                setDirection(-0.5, -0.5);
-            
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_8)
-                setDirection(   0, -1.0);
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_9)
-                setDirection( 0.5, -0.5);
+    if(grid_width > 1) {
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_4)
-                setDirection(-1.0,  0.0);
+        MPI_Datatype columns;
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_5)
-                setDirection( 0.0,  0.0);
+        MPI_Type_vector(unit_height, halo_width, unit_width, mpi_scalar<real>::type(), &columns);
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_6)
-                setDirection( 1.0,  0.0);
+        if(engine == ENGINE_TILED) {
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_1)
-                setDirection(-0.5,  0.5);
+            /* Deep ghost columns are stepped again, so they need every field */
+            MPI_Type_create_hvector(LATTICE_FIELDS, 1, units.stride * sizeof(real), columns, &MPI_TYPE_COLUMNS_LEFT);
+            MPI_Type_commit(&MPI_TYPE_COLUMNS_LEFT);
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_2)
-                setDirection( 0.0,  1.0);
+            MPI_TYPE_COLUMNS_RIGHT = MPI_TYPE_COLUMNS_LEFT;
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_PAD_3)
-                setDirection( 0.5,  0.5);
+        } else {
+
+            face_type(-1, 0, units, columns, &MPI_TYPE_COLUMNS_LEFT);
+            face_type( 1, 0, units, columns, &MPI_TYPE_COLUMNS_RIGHT);
+
+        }
+
+        MPI_Type_free(&columns);
+
+        MPI_Type_vector(unit_height, halo_width, unit_width, MPI_CXX_BOOL, &MPI_TYPE_COLUMNS_BARRIER);
+        MPI_Type_commit(&MPI_TYPE_COLUMNS_BARRIER);
+
+    }
+
+
+    if(engine == ENGINE_TILED) {
+
+        MPI_Type_vector(LATTICE_FIELDS, tile_depth * unit_width, units.stride, mpi_scalar<real>::type(), &MPI_TYPE_TILE);
+        MPI_Type_commit(&MPI_TYPE_TILE);
+
+    }
+
+
+
+    if(migrate_units) {
+
+        compile_geometry();
+        refresh_halos();
+
+    }
+
+}
+
+
+
+/**
+ * Splits the rows of the viewport among the grid rows so that each one gets
+ * a share of cost proportional to its speed, in cost per second of busy time
+ * measured so far. Every rank computes the same split from the same inputs.
+ * Each grid row keeps enough rows for its halos and tiles.
+ */
+static std::vector<size_t> split_rows(const std::vector<double>& cost) {
+
+
+    const size_t rows  = row_offsets.back();
+    const size_t least = std::max<size_t>(tile_depth, 2);
+
+    if(rows < least * grid_height)
+        return row_offsets;
+
+
+    const auto total    = std::accumulate(cost.begin(), cost.end(), 0.0);
+    const auto capacity = std::accumulate(row_speeds.begin(), row_speeds.end(), 0.0);
+
+    std::vector<size_t> offsets(grid_height + 1, rows);
+    offsets[0] = 0;
+
+
+    size_t y = 0;
+
+    double done = 0.0;
+    double goal = 0.0;
+
+    for(auto r = 0; r < grid_height - 1; r++) {
+
+        goal += total * row_speeds[r] / capacity;
+
+        while(y < rows && done + cost[y] / 2 < goal)
+            done += cost[y++];
+
+        y = std::max(y, offsets[r] + least);
+        y = std::min(y, rows - (grid_height - r - 1) * least);
+
+        done = std::accumulate(cost.begin(), cost.begin() + y, 0.0);
+
+        offsets[r + 1] = y;
+
+    }
+
+    return offsets;
+
+}
+
+
+/**
+ * Cost of a viewport row: fluid cells do the full step, solid ones little
+ * more than a bounce-back.
+ */
+static double row_cost(size_t fluid, size_t solid) {
+    return fluid + solid / 4.0;
+}
+
+
+/**
+ * Checks every BALANCE_INTERVAL iterations whether the slowest grid row is
+ * busier than the mean by more than BALANCE_THRESHOLD. If so, every rank
+ * learns the busy time of all others and the cost of every viewport row,
+ * and the rows are split again among the grid rows and migrated.
+ */
+static void balance() {
+
+
+    std::vector<double> times(world_num_procs);
+
+    MPI_Allgather(&busy_time, 1, MPI_DOUBLE, times.data(), 1, MPI_DOUBLE, MPI_COMM_WORLD);
+
+    busy_time = 0.0;
+
+
+    std::vector<double> cost(row_offsets.back(), 0.0);
+
+    for(size_t y = 0; y < block_height; y++) {
+
+        size_t solid = 0;
+
+        for(auto x = halo_left; x < unit_width - halo_right; x++)
+            solid += units.barrier[XY(x, y, unit_width)];
+
+        cost[row_offsets[grid_row] + y] = row_cost(block_width - solid, solid);
+
+    }
+
+    MPI_Allreduce(MPI_IN_PLACE, cost.data(), cost.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+
+
+    std::vector<double> row_times(grid_height, 0.0);
+
+    for(auto i = 0; i < world_num_procs; i++) {
+
+        int c[2];
+        MPI_Cart_coords(MPI_COMM_GRID, i, 2, c);
+
+        row_times[c[0]] = std::max(row_times[c[0]], times[i]);
+
+    }
+
+
+    const auto slowest = *std::max_element(row_times.begin(), row_times.end());
+    const auto mean    = std::accumulate(row_times.begin(), row_times.end(), 0.0) / grid_height;
+
+    if(slowest <= mean * (1.0 + BALANCE_THRESHOLD) || mean <= 0.0)
+        return;
+
+
+    for(auto r = 0; r < grid_height; r++) {
+
+        const auto share = std::accumulate(cost.begin() + row_offsets[r], cost.begin() + row_offsets[r + 1], 0.0);
+
+        if(share > 0.0 && row_times[r] > 0.0)
+            row_speeds[r] = share / row_times[r];
+
+    }
+
+
+    const auto offsets = split_rows(cost);
+
+    if(offsets != row_offsets)
+        decompose(offsets, true);
+
+}
+
+
+
+
+
+/**
+ * Resets are spread over the ranks. The primary only describes
+ * viewport_barrier as the lengths of alternating fluid and solid runs of
+ * cells in row-major order, starting with fluid; each rank then rebuilds its
+ * own block at equilibrium from that and the flow every rank already shares.
+ * Runs too long for 32 bits are split by an empty run of the other kind.
+ */
+static void encode_barrier(std::vector<uint32_t>& runs) {
+
+
+    runs.clear();
+
+    bool solid = false;
+    uint32_t count = 0;
+
+    for(size_t k = 0; k < viewport_width * viewport_height; k++) {
+
+        if(viewport_barrier[k] != solid) {
+
+            runs.push_back(count);
+
+            solid = !solid;
+            count = 0;
+
+        }
+
+        if(count == UINT32_MAX) {
+
+            runs.push_back(count);
+            runs.push_back(0);
+
+            count = 0;
+
+        }
+
+        count++;
+
+    }
+
+    runs.push_back(count);
+
+}
+
+
+/**
+ * Calls f(y, x0, x1) for every row span [x0, x1) of solid cells in runs.
+ */
+template<typename F>
+static void solid_spans(const std::vector<uint32_t>& runs, const F& f) {
+
+
+    size_t k = 0;
+
+    for(size_t i = 0; i < runs.size(); k += runs[i++]) {
+
+        if(i % 2 == 0)
+            continue;
+
+
+        for(size_t first = k, last = k + runs[i]; first < last; ) {
+
+            const auto y   = first / viewport_width;
+            const auto end = std::min<size_t>(last, (y + 1) * viewport_width);
+
+            f(y, first - y * viewport_width, end - y * viewport_width);
+
+            first = end;
+
+        }
+
+    }
+
+}
+
+
+static void reset_units(const std::vector<uint32_t>& runs) {
+
+
+    const auto& r = regions[world_rank];
+
+    for(size_t y = 0; y < block_height; y++)
+        memset(&units.barrier[XY(halo_left, y, unit_width)], 0, block_width * sizeof(bool));
+
+    solid_spans(runs, [&] (size_t y, size_t x0, size_t x1) {
+
+        if(y < r.y || y >= r.y + r.height)
+            return;
+
+        x0 = std::max(x0, r.x);
+        x1 = std::min(x1, r.x + r.width);
+
+        if(x0 < x1)
+            std::fill_n(&units.barrier[XY(halo_left + x0 - r.x, y - r.y, unit_width)], x1 - x0, true);
+
+    });
+
+
+    parallel([] (int t) {
+
+        size_t first, last;
+        partition(t, block_height, first, last);
+
+        for(auto y = first; y < last; y++) {
+
+            for(auto x = halo_left; x < halo_left + block_width; x++) {
+
+                const auto k = XY(x, y, unit_width);
+
+                units.zero(k);
+
+
+                if(units.barrier[k]) {
+
+                    units.ux[k] = 0.0;
+                    units.uy[k] = 0.0;
+
+                } else {
+
+                    units.ux[k] = flow_speed.x();
+                    units.uy[k] = flow_speed.y();
+                    units.eq(k, 1.0, 1.0);
+
+                }
+
+            }
+
+        }
+
+    });
+
+}
+
+
+
+
+
+/**
+ * Picks the columns x rows process grid whose blocks exchange the fewest
+ * halo cells for this viewport. AA and the in-place engine push across
+ * block edges and only exchange rows back, so they stay on one column.
+ */
+static void grid(int procs, int& columns, int& rows) {
+
+
+    columns = 1;
+
+    if(GRID_COLUMNS > 0) {
+
+        columns = GRID_COLUMNS;
+
+    } else if(engine == ENGINE_AB || engine == ENGINE_TILED) {
+
+        size_t best = (size_t) -1;
+
+        for(auto c = 1; c <= procs; c++) {
+
+            if(procs % c != 0 || viewport_width / c < 2 || viewport_height / (procs / c) < 2)
+                continue;
+
+
+            const auto r = procs / c;
+
+            const size_t cost = (r > 1 ? viewport_width / c : 0) + (c > 1 ? viewport_height / r : 0);
+
+            if(cost < best) {
+
+                best    = cost;
+                columns = c;
+
+            }
+
+        }
+
+    }
+
+
+    if(procs % columns != 0 || (columns > 1 && engine != ENGINE_AB && engine != ENGINE_TILED))
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+    rows = procs / columns;
+
+    /* Blocks need not divide the viewport evenly, but each needs two cells each way */
+    if(viewport_width / columns < 2 || viewport_height / rows < 2)
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
+
+}
+
+
+
+
+
+#if !defined(HEADLESS)
+
+static std::atomic<bool> rendering(true);
+
+
+/**
+ * Runs on a thread of its own on the primary, which owns the display from
+ * then on. It serves the UI and draws the latest published frame on every
+ * timer tick, so drawing never holds the solver back; the two only meet in
+ * frame_acquire() and under ui_lock.
+ */
+static void render() {
+
+
+    al_set_target_backbuffer(disp);
+
+    colormap_init();
+
+    painters_start();
+
+
+    while(rendering) {
+
+        ALLEGRO_EVENT e;
+
+        if(!al_wait_for_event_timed(queue, &e, 0.1))
+            continue;
+
+
+        switch(e.type) {
+
+            case ALLEGRO_EVENT_TIMER: {
+
+                if(frame_acquire()) {
+
+                    redraw(&e);
+                    al_flip_display();
+
+                }
+
+                std::lock_guard<std::mutex> guard(ui_lock);
+                requested.gathering = true;
+
+            } break;
+
+            case ALLEGRO_EVENT_KEY_DOWN:
+            case ALLEGRO_EVENT_KEY_UP:
+            case ALLEGRO_EVENT_MOUSE_BUTTON_DOWN:
+            case ALLEGRO_EVENT_MOUSE_BUTTON_UP:
+            case ALLEGRO_EVENT_MOUSE_AXES:
+            case ALLEGRO_EVENT_MOUSE_ENTER_DISPLAY:
+            case ALLEGRO_EVENT_MOUSE_LEAVE_DISPLAY: {
+
+                std::lock_guard<std::mutex> guard(ui_lock);
+                update(&e);
+
+            } break;
+
+            case ALLEGRO_EVENT_DISPLAY_CLOSE: {
+
+                std::lock_guard<std::mutex> guard(ui_lock);
+                requested.running = false;
+
+            } break;
+
+        }
+
+    }
+
+
+    painters_stop();
+
+}
 
+#endif
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_1)
-                draw_mode = 0;
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_2)
-                draw_mode = 1;
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_3)
-                draw_mode = 2;
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_4)
-                draw_mode = 3;
 
-            else if(e->keyboard.keycode == ALLEGRO_KEY_5)
-                draw_mode = 4;
+#if defined(HEADLESS)
 
-            break;
+/**
+ * A headless run takes its domain and flow from the command line instead,
+ * and writes the fields every output_interval steps to numbered files that
+ * start with output_prefix. Every rank parses the same arguments, so no
+ * rank has to be told them; only the primary reads the obstacles. A run
+ * restarted from a checkpoint takes its domain and flow from there, and
+ * run_steps still counts from the start of the original run.
+ */
+static size_t run_steps = ITERATIONS;
+static size_t output_interval = 0;
+static size_t checkpoint_interval = 0;
+static std::string output_prefix = OUTPUT_PREFIX;
+static std::string obstacle_path;
+static std::string restart_path;
 
 
-        case ALLEGRO_EVENT_MOUSE_BUTTON_DOWN:
-        case ALLEGRO_EVENT_MOUSE_AXES:
+static bool configure(int argc, char** argv) {
 
-            if(e->mouse.pressure > 0) {
 
-                setBarrier(e->mouse.x / VIEWPORT_BLOCKSIZE, e->mouse.y / VIEWPORT_BLOCKSIZE);
+    static const option options[] = {
+        { "width",     required_argument, nullptr, 'W' },
+        { "height",    required_argument, nullptr, 'H' },
+        { "steps",     required_argument, nullptr, 's' },
+        { "viscosity", required_argument, nullptr, 'v' },
+        { "inflow",    required_argument, nullptr, 'u' },
+        { "obstacles", required_argument, nullptr, 'b' },
+        { "output",    required_argument, nullptr, 'o' },
+        { "every",     required_argument, nullptr, 'e' },
+        { "checkpoint",       required_argument, nullptr, 'c' },
+        { "checkpoint-every", required_argument, nullptr, 'C' },
+        { "restart",          required_argument, nullptr, 'r' },
+        { nullptr,     0,                 nullptr,  0  }
+    };
 
-            }
 
+    /* strtoull would take a sign or leading blanks, so only digits are let through */
+    const auto count = [] (size_t& value) {
 
-            setCurrentUnit(e->mouse.x / VIEWPORT_BLOCKSIZE, e->mouse.y / VIEWPORT_BLOCKSIZE);
+        if(*optarg < '0' || *optarg > '9')
+            return false;
 
-            break;
+        char* end;
 
-    }
+        errno = 0;
+        value = strtoull(optarg, &end, 10);
 
+        return errno != ERANGE && *end == '\0';
 
+    };
 
-}
 
+    for(int c; (c = getopt_long(argc, argv, "W:H:s:v:u:b:o:e:c:C:r:", options, nullptr)) != -1; ) {
 
+        switch(c) {
 
+            case 'W':
+                if(!count(viewport_width))
+                    return false;
+                break;
 
+            case 'H':
+                if(!count(viewport_height))
+                    return false;
+                break;
 
-int main(int argc, char** argv) {
+            case 's':
+                if(!count(run_steps) || run_steps == 0)
+                    return false;
+                break;
 
+            case 'e':
+                if(!count(output_interval))
+                    return false;
+                break;
 
-    MPI_Init(&argc, &argv);
-    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &world_num_procs);
+            case 'v': {
 
+                char* end;
+                requested.viscosity = strtod(optarg, &end);
 
+                if(*optarg == '\0' || *end != '\0' || !(requested.viscosity > 0))
+                    return false;
 
-    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, world_rank, MPI_INFO_NULL, &MPI_COMM_LOCAL);
+            } break;
 
-    /**
-     * Divisione in gruppi a scopo di test
-     *
-     * MPI_Comm_split(MPI_COMM_WORLD, world_rank, world_rank, &MPI_COMM_LOCAL);                             // 1 nodo per ogni gruppo
-     * MPI_Comm_split(MPI_COMM_WORLD, world_rank < (world_num_procs / 2), world_rank, &MPI_COMM_LOCAL);     // n/2 nodi per ogni gruppo
-     */
+            case 'u': {
 
+                char* end;
+                const double ux = strtod(optarg, &end);
 
+                if(end == optarg || (*end != '\0' && *end != ','))
+                    return false;
 
+                double uy = 0.0;
 
-    MPI_Comm_rank(MPI_COMM_LOCAL, &local_rank);
-    MPI_Comm_size(MPI_COMM_LOCAL, &local_num_procs);
+                if(*end == ',') {
 
+                    const char* first = end + 1;
+                    uy = strtod(first, &end);
 
-    assert(world_num_procs > 0);
-    assert(local_num_procs > 0);
+                    if(end == first || *end != '\0')
+                        return false;
 
+                }
 
+                requested.speed = v2d(ux, uy);
 
+            } break;
 
-#if !defined(BENCH)
+            case 'b':
+                obstacle_path = optarg;
+                break;
 
-    std::cout << "Running Node " << world_rank << " of " << world_num_procs 
-              << " (" << local_rank << " of " << local_num_procs << ")" << std::endl;
+            case 'o':
+                output_prefix = optarg;
+                break;
 
-#endif
+            case 'c':
+                checkpoint_path = optarg;
+                break;
 
+            case 'C':
+                if(!count(checkpoint_interval))
+                    return false;
+                break;
 
+            case 'r':
+                restart_path = optarg;
+                break;
 
+            default:
+                return false;
 
+        }
 
+    }
 
 
+    /* Frame counts and offsets are ints, so the whole viewport has to fit one */
+    const size_t cells = std::numeric_limits<int>::max();
 
-    MPI_Datatype v2d_types[] = { MPI_DOUBLE, MPI_DOUBLE };
-    MPI_Aint v2d_offsets[]   = { 0, sizeof(double) };
-    int v2d_blocks[]         = { 1, 1 };
+    return optind == argc && viewport_width >= 3 && viewport_height >= 3 && viewport_width <= cells / viewport_height
+        && (checkpoint_interval == 0 || !checkpoint_path.empty());
 
-    MPI_Type_create_struct(2, v2d_blocks, v2d_offsets, v2d_types, &MPI_TYPE_V2D);
-    MPI_Type_commit(&MPI_TYPE_V2D);
+}
 
 
+/**
+ * Reads the barrier from a PBM image the size of the viewport, plain (P1)
+ * or raw (P4), black cells solid. The border cells stay fluid, as they do
+ * with setBarrier().
+ */
+static bool load_obstacles(const std::string& path) {
 
 
+    std::ifstream in(path, std::ios::binary);
 
-    MPI_Datatype unit_types[] =
-        { MPI_DOUBLE, MPI_CXX_BOOL, MPI_TYPE_V2D, MPI_DOUBLE, MPI_DOUBLE };
-        
-    MPI_Aint unit_offsets[] = {
-        offsetof(unit, n),
-        offsetof(unit, barrier),
-        offsetof(unit, u),
-        offsetof(unit, rho),
-        offsetof(unit, curl),
-    };
+    const auto skip = [&] () {
 
-    int unit_blocks[] = { 9, 1, 1, 1, 1 };
+        while((in >> std::ws) && in.peek() == '#')
+            in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 
+    };
 
-    MPI_Type_create_struct(5, unit_blocks, unit_offsets, unit_types, &MPI_TYPE_UNIT);
-    MPI_Type_commit(&MPI_TYPE_UNIT);
 
+    std::string magic;
+    size_t width  = 0;
+    size_t height = 0;
 
+    in >> magic;
+    skip();
+    in >> width;
+    skip();
+    in >> height;
 
+    if(!in || (magic != "P1" && magic != "P4") || width != viewport_width || height != viewport_height)
+        return false;
 
+    const bool raw = magic == "P4";
 
-#if !defined(BENCH)
+    if(raw)
+        in.get();
 
-    if(world_rank == PRIMARY) {
 
+    std::vector<uint8_t> row((width + 7) / 8);
 
-        al_init();
-        al_install_keyboard();
-        al_install_mouse();
+    for(size_t y = 0; y < height; y++) {
 
-        al_set_app_name("WIND - APSD");
+        if(raw)
+            in.read((char*) row.data(), row.size());
 
-    
-        if((queue = al_create_event_queue()) == NULL)
-            return std::cerr << "al_create_event_queue() failed!" << std::endl, 1;
 
-        if((disp = al_create_display(WINDOW_WIDTH, WINDOW_HEIGHT)) == NULL)
-            return std::cerr << "al_create_display() failed!" << std::endl, 1;
+        for(size_t x = 0; x < width; x++) {
 
-        if((timer = al_create_timer(1.0 / WINDOW_FPS)) == NULL)
-            return std::cerr << "al_create_timer() failed!" << std::endl, 1;
+            bool solid;
 
-        if((font = al_create_builtin_font()) == NULL)
-            return std::cerr << "al_create_builtin_font() failed!" << std::endl, 1;
+            if(raw)
+                solid = row[x >> 3] & (0x80 >> (x & 7));
 
+            else {
 
+                char c = '0';
+                in >> c;
 
-        al_set_window_title(disp, "WIND - Parallel Algorithm and Data Structures - Exam");
+                solid = c == '1';
 
+            }
 
-        al_register_event_source(queue, al_get_keyboard_event_source());
-        al_register_event_source(queue, al_get_mouse_event_source());
-        al_register_event_source(queue, al_get_display_event_source(disp));
-        al_register_event_source(queue, al_get_timer_event_source(timer));
+            if(x > 0 && y > 0 && x < width - 1 && y < height - 1)
+                viewport_barrier[XY(x, y, width)] = solid;
 
-        al_start_timer(timer);
+        }
 
     }
 
+    return (bool) in;
+
+}
 
 #endif
 
 
 
-    const size_t unit_width  = VIEWPORT_WIDTH;
-    const size_t unit_height = VIEWPORT_HEIGHT / world_num_procs;
-    const size_t unit_size   = unit_width * unit_height;
 
-    if(MPI_Win_allocate_shared (unit_size * sizeof(struct unit), sizeof(struct unit), MPI_INFO_NULL, MPI_COMM_LOCAL, &units, &MPI_LOCAL_WINDOW) != MPI_SUCCESS)
-        MPI_Abort(MPI_COMM_WORLD, __LINE__);
 
+int main(int argc, char** argv) {
 
 
-    if(world_rank == PRIMARY) {
+    int provided;
+
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_num_procs);
 
-        frame = new unit[VIEWPORT_WIDTH * VIEWPORT_HEIGHT];
+    /* The render thread and the pool workers run beside the one thread that talks to MPI */
+    if(provided < MPI_THREAD_FUNNELED) {
 
-        if(!frame)
-            MPI_Abort(MPI_COMM_WORLD, __LINE__);
+        if(world_rank == PRIMARY)
+            std::cerr << "MPI_THREAD_FUNNELED is not supported by this MPI library" << std::endl;
 
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
 
     }
 
 
 
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, world_rank, MPI_INFO_NULL, &MPI_COMM_LOCAL);
 
-    up_units = new unit[unit_width];
-    bottom_units = new unit[unit_width];
+    /**
+     * Divisione in gruppi a scopo di test
+     *
+     * MPI_Comm_split(MPI_COMM_WORLD, world_rank, world_rank, &MPI_COMM_LOCAL);                             // 1 nodo per ogni gruppo
+     * MPI_Comm_split(MPI_COMM_WORLD, world_rank < (world_num_procs / 2), world_rank, &MPI_COMM_LOCAL);     // n/2 nodi per ogni gruppo
+     */
 
 
-    if(!up_units || !bottom_units)
-        MPI_Abort(MPI_COMM_WORLD, __LINE__);
 
 
-    
+    MPI_Comm_rank(MPI_COMM_LOCAL, &local_rank);
+    MPI_Comm_size(MPI_COMM_LOCAL, &local_num_procs);
 
 
+    assert(world_num_procs > 0);
+    assert(local_num_procs > 0);
 
 
-#if defined(BENCH)
 
-    double bench_start = MPI_Wtime();
+#if defined(HEADLESS)
 
-#endif
+    opterr = world_rank == PRIMARY;
 
+    if(!configure(argc, argv)) {
 
-    do {
+        if(world_rank == PRIMARY)
+            std::cerr << "Usage: " << argv[0] << " [--width N] [--height N] [--steps N] [--viscosity W] [--inflow UX[,UY]]"
+                      << " [--obstacles FILE] [--output PREFIX] [--every N]"
+                      << " [--checkpoint FILE] [--checkpoint-every N] [--restart FILE]" << std::endl;
 
+        MPI_Finalize();
+        return 1;
 
-#if !defined(BENCH)
+    }
 
-        if(world_rank == PRIMARY) {
 
-            ALLEGRO_EVENT e;
-            if(al_get_next_event(queue, &e)) {
+    checkpoint_header restart = { };
 
-                
-                switch(e.type) {
+    if(!restart_path.empty()) {
 
-                    case ALLEGRO_EVENT_TIMER:
-                        redraw(&e);
-                        al_flip_display();
-                        break;
+        if(!checkpoint_read_header(restart_path, restart) || restart.iterations >= run_steps) {
 
-                    case ALLEGRO_EVENT_KEY_DOWN:
-                    case ALLEGRO_EVENT_KEY_UP:
-                    case ALLEGRO_EVENT_MOUSE_BUTTON_DOWN:
-                    case ALLEGRO_EVENT_MOUSE_BUTTON_UP:
-                    case ALLEGRO_EVENT_MOUSE_AXES:
-                    case ALLEGRO_EVENT_MOUSE_ENTER_DISPLAY:
-                    case ALLEGRO_EVENT_MOUSE_LEAVE_DISPLAY:
-                        update(&e);
-                        break;
+            if(world_rank == PRIMARY)
+                std::cerr << "Cannot restart from " << restart_path << " for " << run_steps << " steps with this build" << std::endl;
 
-                    case ALLEGRO_EVENT_DISPLAY_CLOSE:
-                        running = false;
-                        break;
+            MPI_Finalize();
+            return 1;
 
-                }
+        }
 
-            }
+        viewport_width      = restart.width;
+        viewport_height     = restart.height;
+        requested.viscosity = restart.viscosity;
+        requested.speed     = v2d(restart.speed[0], restart.speed[1]);
 
-        }
+    }
+
+    flow_viscosity = requested.viscosity;
+    flow_speed     = requested.speed;
+    message        = requested;
 
 #endif
 
 
 
-        MPI_Bcast(&resetting,       1, MPI_CXX_BOOL, PRIMARY, MPI_COMM_WORLD);
-        MPI_Bcast(&running,         1, MPI_CXX_BOOL, PRIMARY, MPI_COMM_WORLD);
-        MPI_Bcast(&paused,          1, MPI_CXX_BOOL, PRIMARY, MPI_COMM_WORLD);
-        MPI_Bcast(&flow_viscosity,  1, MPI_DOUBLE,   PRIMARY, MPI_COMM_WORLD);
-        MPI_Bcast(&flow_speed,      1, MPI_TYPE_V2D, PRIMARY, MPI_COMM_WORLD);
-        MPI_Bcast(&draw_mode,       1, MPI_INT,      PRIMARY, MPI_COMM_WORLD);
 
+#if SIMD >= SIMD_AVX512
 
+    if(__builtin_cpu_supports("avx512f"))
+        simd = SIMD_AVX512;
 
-#if defined(BENCH)
-        
-        static uint32_t iterations = 0;
+    else
 
-        if(++iterations == ITERATIONS)
-            running = false;
+#endif
+
+#if SIMD >= SIMD_AVX2
+
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        simd = SIMD_AVX2;
 
 #endif
 
 
 
 
-        MPI_Barrier(MPI_COMM_WORLD);
+    pool_start();
 
-        
 
-        if(__sync_bool_compare_and_swap(&resetting, true, false)) {
 
+#if !defined(BENCH)
 
-            if(world_rank != PRIMARY) {
-                MPI_Recv(units, unit_size, MPI_TYPE_UNIT, PRIMARY, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    static const char* simd_names[] = { "scalar", "avx2", "avx512" };
 
+    std::cout << "Running Node " << world_rank << " of " << world_num_procs 
+              << " (" << local_rank << " of " << local_num_procs << ") [" << simd_names[simd] << ", " << num_threads << " threads]" << std::endl;
 
-            } else {
+#endif
 
 
-                
-                for(auto x = 0; x < VIEWPORT_WIDTH; x++) {
-                    for(auto y = 0; y < VIEWPORT_HEIGHT; y++) {
 
-                        auto& i = frame[XY(x, y, VIEWPORT_WIDTH)];
 
-                        i.zero();
 
 
-                        if(i.barrier) {
 
-                            i.rho = 0.0;
-                            i.u = v2d();
 
-                        } else {
+#if !defined(HEADLESS)
 
-                            i.rho = 1.0;
-                            i.u = flow_speed;
-                            i.eq(1.0, 1.0);
+    if(world_rank == PRIMARY) {
 
-                        }
 
-                    }
-                }
+        al_init();
+        al_install_keyboard();
+        al_install_mouse();
+
+        al_set_app_name("WIND - APSD");
+
+    
+        if((queue = al_create_event_queue()) == NULL)
+            return std::cerr << "al_create_event_queue() failed!" << std::endl, 1;
 
+        if((disp = al_create_display(WINDOW_WIDTH, WINDOW_HEIGHT)) == NULL)
+            return std::cerr << "al_create_display() failed!" << std::endl, 1;
 
-                for(auto i = PRIMARY; i < world_num_procs; i++) {
+        if((timer = al_create_timer(1.0 / WINDOW_FPS)) == NULL)
+            return std::cerr << "al_create_timer() failed!" << std::endl, 1;
 
+        if((font = al_create_builtin_font()) == NULL)
+            return std::cerr << "al_create_builtin_font() failed!" << std::endl, 1;
 
-                    if(i == PRIMARY)
-                        memcpy(units, &frame[XY(0, i * unit_height, VIEWPORT_WIDTH)], unit_size * sizeof(unit));
+        if((field = al_create_bitmap(viewport_width, viewport_height)) == NULL)
+            return std::cerr << "al_create_bitmap() failed!" << std::endl, 1;
 
-                    else
-                    
-                        MPI_Send(&frame[XY(0, i * unit_height, VIEWPORT_WIDTH)], unit_size, MPI_TYPE_UNIT, i, 0, MPI_COMM_WORLD);
-                    
 
-                }
 
+        al_set_window_title(disp, "WIND - Parallel Algorithm and Data Structures - Exam");
 
 
+        al_register_event_source(queue, al_get_keyboard_event_source());
+        al_register_event_source(queue, al_get_mouse_event_source());
+        al_register_event_source(queue, al_get_display_event_source(disp));
+        al_register_event_source(queue, al_get_timer_event_source(timer));
 
+        al_start_timer(timer);
 
-            }
+        /* The render thread takes the display over */
+        al_set_target_bitmap(NULL);
 
-        }
+    }
 
 
+#endif
 
-        if(paused)
-            continue;
 
 
+    grid(world_num_procs, grid_width, grid_height);
 
-        for(auto x = 0; x < unit_width; x++) {
-            for(auto y = 0; y < unit_height; y++) {
 
-                if(!units[XY(x, y, unit_width)].barrier) {
+    int dims[2]    = { grid_height, grid_width };
+    int periods[2] = { 0, 0 };
 
-                    auto& i = units[XY(x, y, unit_width)];
-                    auto rho = i.new_rho();
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &MPI_COMM_GRID);
 
+    MPI_Cart_shift(MPI_COMM_GRID, 0, 1, &up_peer.rank,   &bottom_peer.rank);
+    MPI_Cart_shift(MPI_COMM_GRID, 1, 1, &left_peer.rank, &right_peer.rank);
 
-                    if(rho > 0.0) {
 
-                        i.u.x() = ((i.nE + i.nNE + i.nSE - i.nW - i.nNW - i.nSW) / rho);
-                        i.u.y() = ((i.nN + i.nNE + i.nNW - i.nS - i.nSE - i.nSW) / rho);
+    int coords[2];
+    MPI_Cart_coords(MPI_COMM_GRID, world_rank, 2, coords);
 
-                    } else
+    grid_row    = coords[0];
+    grid_column = coords[1];
 
-                        i.u = v2d();
-                    
 
-                    i.eq(flow_viscosity, rho);
+    column_offsets.resize(grid_width + 1);
 
+    for(auto c = 0; c <= grid_width; c++)
+        column_offsets[c] = viewport_width * c / grid_width;
 
-                }
+    block_width = column_offsets[grid_column + 1] - column_offsets[grid_column];
 
-            }
-        }
 
+    /* The narrowest and shortest blocks get the rounded down share */
+    if(engine == ENGINE_TILED)
+        tile_depth = std::min<size_t>({ TILE_DEPTH, (size_t) viewport_width / grid_width, (size_t) viewport_height / grid_height });
 
-        for(auto y = 0; y < unit_height; y++) {
-    
-            const auto& u = flow_speed;
+    halo_width = grid_width > 1 ? (engine == ENGINE_TILED ? tile_depth : 1) : 0;
+    halo_left  = left_peer  ? halo_width : 0;
+    halo_right = right_peer ? halo_width : 0;
 
-            units[XY(0, y, unit_width)].nE  = W[1] * (1 + 3 * v2d::dot(E[1], u) + 4.5 * v2d::dot2(E[1], u) - 1.5 * u.len2());
-            units[XY(0, y, unit_width)].nNE = W[5] * (1 + 3 * v2d::dot(E[5], u) + 4.5 * v2d::dot2(E[5], u) - 1.5 * u.len2());
-            units[XY(0, y, unit_width)].nSE = W[8] * (1 + 3 * v2d::dot(E[8], u) + 4.5 * v2d::dot2(E[8], u) - 1.5 * u.len2());
 
+    unit_width = halo_left + block_width + halo_right;
 
-            units[XY(unit_width - 1, y, unit_width)].nW  = W[3] * (1 + 3 * v2d::dot(E[3], u) + 4.5 * v2d::dot2(E[3], u) - 1.5 * u.len2());
-            units[XY(unit_width - 1, y, unit_width)].nNW = W[6] * (1 + 3 * v2d::dot(E[6], u) + 4.5 * v2d::dot2(E[6], u) - 1.5 * u.len2());
-            units[XY(unit_width - 1, y, unit_width)].nSW = W[7] * (1 + 3 * v2d::dot(E[7], u) + 4.5 * v2d::dot2(E[7], u) - 1.5 * u.len2());
 
+    const auto peer_width = [] (int x) -> size_t {
 
-        }
-            
+        if(x < 0 || x >= grid_width)
+            return 0;
 
+        return column_offsets[x + 1] - column_offsets[x] + (x > 0 ? halo_width : 0) + (x < grid_width - 1 ? halo_width : 0);
 
+    };
 
+    up_peer.width     = unit_width;
+    bottom_peer.width = unit_width;
+    left_peer.width   = peer_width(grid_column - 1);
+    right_peer.width  = peer_width(grid_column + 1);
 
 
+    MPI_Group world_group;
+    MPI_Group local_group;
 
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    MPI_Comm_group(MPI_COMM_LOCAL, &local_group);
 
+    for(auto* p : { &up_peer, &bottom_peer, &left_peer, &right_peer }) {
 
-        
-        MPI_Win_fence(0, MPI_LOCAL_WINDOW);
+        if(*p)
+            MPI_Group_translate_ranks(world_group, 1, &p->rank, local_group, &p->local);
 
+    }
 
-        #define LOCAL_WIDTH     (unit_width)
-        #define LOCAL_HEIGHT    (unit_height)
+    MPI_Group_free(&world_group);
+    MPI_Group_free(&local_group);
 
 
 
+    if(world_rank == PRIMARY) {
 
-        for(auto x = 0; x < LOCAL_WIDTH - 1; x++) {
-            for(auto y = LOCAL_HEIGHT - 1; y > 0; y--) {
+        viewport_barrier.assign(viewport_width * viewport_height, false);
 
-                units[XY(x, y, LOCAL_WIDTH)].nN  = units[XY(x + 0, y - 1, LOCAL_WIDTH)].nN;
-                units[XY(x, y, LOCAL_WIDTH)].nNW = units[XY(x + 1, y - 1, LOCAL_WIDTH)].nNW;
 
-            }
-        }
+#if defined(BENCH)
 
-        for(auto x = LOCAL_WIDTH - 1; x > 0; x--) {
-            for(auto y = LOCAL_HEIGHT - 1; y > 0; y--) {
+        if(!lattice_alloc(frame, viewport_width, viewport_height))
+            MPI_Abort(MPI_COMM_WORLD, __LINE__);
 
-                units[XY(x, y, LOCAL_WIDTH)].nE  = units[XY(x - 1, y, LOCAL_WIDTH)].nE;
-                units[XY(x, y, LOCAL_WIDTH)].nNE = units[XY(x - 1, y - 1, LOCAL_WIDTH)].nNE;
+#endif
 
-            }
-        }
+#if !defined(HEADLESS)
 
-        
-        for(auto y = LOCAL_HEIGHT - 1; y > 0; y--)
-            units[XY(LOCAL_WIDTH - 1, y, LOCAL_WIDTH)].nN = units[XY(LOCAL_WIDTH - 1, y - 1, LOCAL_WIDTH)].nN;
+        for(auto& buffer : frames)
+            buffer.shades.assign(viewport_width * viewport_height, 0);
 
+#endif
 
+#if defined(BENCH_DUMP)
 
+        for(auto y = viewport_height / 4; y < viewport_height * 3 / 4; y++)
+            setBarrier(viewport_width / 4, y);
 
-        if(world_num_procs > 1) {
+#endif
 
+#if defined(HEADLESS)
 
-            if(world_rank != PRIMARY) {
+        if(!obstacle_path.empty() && !load_obstacles(obstacle_path)) {
 
-                if(local_rank == PRIMARY) {
+            std::cerr << "Cannot read a " << viewport_width << "x" << viewport_height << " PBM image from " << obstacle_path << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, __LINE__);
 
-                    MPI_Sendrecv (
-                        &units[0],    unit_width, MPI_TYPE_UNIT, world_rank - 1, 0,
-                        &up_units[0], unit_width, MPI_TYPE_UNIT, world_rank - 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE
-                    );
+        }
 
-                } else {
+#endif
 
-                    memcpy(&up_units[0], (void*) ((uintptr_t) &units[0] - (LOCAL_WIDTH * sizeof(unit))), LOCAL_WIDTH * sizeof(unit));
+    }
 
-                }
 
 
-                for(auto x = 0; x < LOCAL_WIDTH - 1; x++) {
 
-                    units[XY(x, 0, LOCAL_WIDTH)].nN  = up_units[XY(x + 0, 0, LOCAL_WIDTH)].nN;
-                    units[XY(x, 0, LOCAL_WIDTH)].nNW = up_units[XY(x + 1, 0, LOCAL_WIDTH)].nNW;
-                    
-                }
+    if(!lattice_alloc(up_units, unit_width, 1) || !lattice_alloc(bottom_units, unit_width, 1))
+        MPI_Abort(MPI_COMM_WORLD, __LINE__);
 
-                for(auto x = LOCAL_WIDTH - 1; x > 0; x--) {
 
-                    units[XY(x, 0, LOCAL_WIDTH)].nNE = up_units[XY(x - 1, 0, LOCAL_WIDTH)].nNE;
-                    
-                }
+    if(engine == ENGINE_TILED) {
 
+        for(auto i = 0; i < 2; i++) {
 
-                units[XY(LOCAL_WIDTH - 1, 0, LOCAL_WIDTH)].nN = up_units[XY(LOCAL_WIDTH - 1, 0, LOCAL_WIDTH)].nN;
+            if(!lattice_alloc(up_tiles[i], unit_width, tile_depth) || !lattice_alloc(bottom_tiles[i], unit_width, tile_depth))
+                MPI_Abort(MPI_COMM_WORLD, __LINE__);
 
+        }
 
+    }
 
 
-                for(auto x = 1; x < LOCAL_WIDTH - 1; x++) {
 
-                    units[XY(x, 0, LOCAL_WIDTH)].curl = (units[XY(x + 1, 0, LOCAL_WIDTH)].u.y() - units[XY(x - 1, 0, LOCAL_WIDTH)].u.y())
-                                                      - (units[XY(x, 1, LOCAL_WIDTH)].u.x() - up_units[XY(x, 0, LOCAL_WIDTH)].u.x());
-                    
-                }
 
 
+    row_types(up_units, &MPI_TYPE_FACE_UP, &MPI_TYPE_FACE_DOWN);
 
-                for(auto x = 0; x < LOCAL_WIDTH - 1; x++) {
 
-                    units[XY(x, 0, LOCAL_WIDTH)].nW  = units[XY(x + 1, 0, LOCAL_WIDTH)].nW;
-                    units[XY(x, 0, LOCAL_WIDTH)].nSW = units[XY(x + 1, 1, LOCAL_WIDTH)].nSW;
+    pushed_type(-1, up_units.stride, &MPI_TYPE_HALO_UP);
+    pushed_type( 1, up_units.stride, &MPI_TYPE_HALO_DOWN);
 
 
-                }
+    if(engine == ENGINE_TILED) {
 
+        MPI_Type_vector(LATTICE_FIELDS, tile_depth * unit_width, up_tiles[0].stride, mpi_scalar<real>::type(), &MPI_TYPE_TILE_HALO);
+        MPI_Type_commit(&MPI_TYPE_TILE_HALO);
 
-                for(auto x = LOCAL_WIDTH - 1; x > 0; x--) {
+    }
 
-                    units[XY(x, 0, LOCAL_WIDTH)].nS  = units[XY(x, 1, LOCAL_WIDTH)].nS;
-                    units[XY(x, 0, LOCAL_WIDTH)].nSE = units[XY(x - 1, 1, LOCAL_WIDTH)].nSE;
-                    units[XY(x, 0, LOCAL_WIDTH)].nE  = units[XY(x - 1, 0, LOCAL_WIDTH)].nE;
 
 
-                }
+    std::vector<size_t> offsets(grid_height + 1);
 
+    for(auto r = 0; r <= grid_height; r++)
+        offsets[r] = viewport_height * r / grid_height;
 
-                units[XY(0, 0, LOCAL_WIDTH)].nS = units[XY(0, 1, LOCAL_WIDTH)].nS;
+    row_speeds.assign(grid_height, 1.0);
 
+    decompose(offsets, false);
 
-            }
 
+    
 
-        } else {
 
-            for(auto x = 0; x < LOCAL_WIDTH; x++) {
+    /* The first reset is already pending, edits made during setup are part of it */
+    requested.resetting = false;
+    barrier_edits.clear();
 
-                units[XY(x, 0, LOCAL_WIDTH)].zero();
-                units[XY(x, 0, LOCAL_WIDTH)].eq(1, 1);
+    size_t ticks = 0;
 
-            }
 
-        }
+#if defined(HEADLESS)
 
-        
+    size_t iterations = 0;
 
+    /* The state comes from the checkpoint instead of the first reset */
+    if(!restart_path.empty()) {
 
+        checkpoint_restore(restart_path, restart);
 
+        iterations = restart.iterations;
+        resetting  = false;
 
+    }
 
+#endif
 
 
-        for(auto x = LOCAL_WIDTH - 1; x > 0; x--) {
-            for(auto y = 0; y < LOCAL_HEIGHT - 1; y++) {
+#if !defined(HEADLESS)
 
-                units[XY(x, y, LOCAL_WIDTH)].nS  = units[XY(x, y + 1, LOCAL_WIDTH)].nS;
-                units[XY(x, y, LOCAL_WIDTH)].nSE = units[XY(x - 1, y + 1, LOCAL_WIDTH)].nSE;
+    std::thread renderer;
 
-            }
-        }
+    if(world_rank == PRIMARY)
+        renderer = std::thread(render);
 
-        for(auto x = 0; x < LOCAL_WIDTH - 1; x++) {
-            for(auto y = 0; y < LOCAL_HEIGHT - 1; y++) {
+#endif
 
-                units[XY(x, y, LOCAL_WIDTH)].nW  = units[XY(x + 1, y, LOCAL_WIDTH)].nW;
-                units[XY(x, y, LOCAL_WIDTH)].nSW = units[XY(x + 1, y + 1, LOCAL_WIDTH)].nSW;
 
-            }
-        }   
+#if defined(HEADLESS)
 
+    double bench_start = MPI_Wtime();
 
+#endif
 
-        for(auto y = 0; y < LOCAL_HEIGHT - 1; y++)
-            units[XY(0, y, LOCAL_WIDTH)].nS = units[XY(0, y + 1, LOCAL_WIDTH)].nS;
 
+    do {
 
 
+        if(ticks++ % CONTROL_INTERVAL == 0)
+            control_exchange();
 
 
 
-        if(world_num_procs > 1) {
+        size_t steps = engine == ENGINE_TILED && units_primed ? tile_depth : 1;
 
 
-            if(world_rank != (world_num_procs - 1)) {
+#if defined(HEADLESS)
 
-                if(local_rank == local_num_procs - 1) {
+        steps = std::min<size_t>(steps, run_steps - iterations);
 
-                    MPI_Sendrecv (
-                        &units[XY(0, LOCAL_HEIGHT - 1, LOCAL_WIDTH)], unit_width, MPI_TYPE_UNIT, world_rank + 1, 0,
-                        &bottom_units[0],                             unit_width, MPI_TYPE_UNIT, world_rank + 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE
-                    );
+        /* Tiles never run past an output or a checkpoint */
+        for(const auto interval : { output_interval, checkpoint_interval }) {
 
-                } else {
+            if(interval > 0)
+                steps = std::min<size_t>(steps, interval - iterations % interval);
 
-                    memcpy(&bottom_units[0], &units[XY(0, LOCAL_HEIGHT, LOCAL_WIDTH)], LOCAL_WIDTH * sizeof(unit));
+        }
 
-                }
+        if((iterations += steps) == run_steps)
+            running = false;
 
+#endif
 
-                for(auto x = 0; x < LOCAL_WIDTH - 1; x++) {
 
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nSW = bottom_units[XY(x + 1, 0, LOCAL_WIDTH)].nSW;
-                    
-                }
 
-                for(auto x = LOCAL_WIDTH - 1; x > 0; x--) {
 
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nS  = bottom_units[XY(x + 0, 0, LOCAL_WIDTH)].nS;
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nSE = bottom_units[XY(x - 1, 0, LOCAL_WIDTH)].nSE;
-                
-                }
+        if(__sync_bool_compare_and_swap(&resetting, true, false)) {
 
 
-                units[XY(0, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nS = bottom_units[XY(0, 0, LOCAL_WIDTH)].nS;
+            gather_wait();
 
+            MPI_Win_fence(0, MPI_LOCAL_WINDOW);
 
 
+            std::vector<uint32_t> runs;
 
-                for(int x = 1; x < LOCAL_WIDTH - 1; x++) {
+            if(world_rank == PRIMARY) {
 
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].curl = (units[XY(x + 1, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].u.y() - units[XY(x - 1, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].u.y())
-                                                                     - (bottom_units[XY(x, 0, LOCAL_WIDTH)].u.x() - units[XY(x, LOCAL_HEIGHT - 2, LOCAL_WIDTH)].u.x());
-                    
-                }
+                std::lock_guard<std::mutex> guard(ui_lock);
 
+                encode_barrier(runs);
 
+            }
 
+            uint64_t count = runs.size();
 
-                for(auto x = 0; x < LOCAL_WIDTH - 1; x++) {
+            MPI_Bcast(&count, 1, MPI_UINT64_T, PRIMARY, MPI_COMM_WORLD);
 
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nN  = units[XY(x + 0, LOCAL_HEIGHT - 2, LOCAL_WIDTH)].nN;
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nNW = units[XY(x + 1, LOCAL_HEIGHT - 2, LOCAL_WIDTH)].nNW;
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nW  = units[XY(x + 1, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nW;
+            runs.resize(count);
 
+            MPI_Bcast(runs.data(), count, MPI_UINT32_T, PRIMARY, MPI_COMM_WORLD);
 
-                }
 
+            /* The geometry may have changed, so the rows are split again before the state is rebuilt */
+            std::vector<size_t> solid(row_offsets.back(), 0);
 
-                for(auto x = LOCAL_WIDTH - 1; x > 0; x--) {
+            solid_spans(runs, [&] (size_t y, size_t x0, size_t x1) {
+                solid[y] += x1 - x0;
+            });
 
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nE  = units[XY(x - 1, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nE;
-                    units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nNE = units[XY(x - 1, LOCAL_HEIGHT - 2, LOCAL_WIDTH)].nNE;
+            std::vector<double> cost(solid.size());
 
-                }
+            for(size_t y = 0; y < cost.size(); y++)
+                cost[y] = row_cost(viewport_width - solid[y], solid[y]);
 
+            const auto offsets = split_rows(cost);
 
-                units[XY(LOCAL_WIDTH - 1, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].nN = units[XY(LOCAL_WIDTH - 1, LOCAL_HEIGHT - 2, LOCAL_WIDTH)].nN;
+            if(offsets != row_offsets)
+                decompose(offsets, false);
 
 
-            }
-            
+            reset_units(runs);
 
-        } else {
 
-            for(auto x = 0; x < LOCAL_WIDTH; x++) {
 
-                units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].zero();
-                units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].eq(1, 1);
+            if(engine == ENGINE_AB || engine == ENGINE_TILED) {
+
+                back_units.copy(0, units, 0, unit_size);
+                memcpy(back_units.barrier, units.barrier, unit_size * sizeof(bool));
 
             }
 
-        }
+            units_primed = false;
 
+            compile_geometry();
+
+        }
 
 
 
+        if(!paused) {
 
+            switch(engine) {
 
+                case ENGINE_AB:
+                    step_ab();
+                    break;
 
-        if(world_rank == (world_num_procs - 1)) {
+                case ENGINE_AA:
+                    step_aa();
+                    break;
 
-            for(auto x = 0; x < LOCAL_WIDTH; x++) {
+                case ENGINE_TILED:
+                    step_tiled(steps);
+                    break;
 
-                units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].zero();
-                units[XY(x, LOCAL_HEIGHT - 1, LOCAL_WIDTH)].eq(1, 1);
+                default:
+                    step_inplace();
+                    break;
 
             }
 
         }
 
-        if(world_rank == PRIMARY) {
 
-            for(auto x = 0; x < LOCAL_WIDTH; x++) {
 
-                units[XY(x, 0, LOCAL_WIDTH)].zero();
-                units[XY(x, 0, LOCAL_WIDTH)].eq(1, 1);
-
-            }
+#if defined(HEADLESS)
 
+        if(output_interval > 0 && iterations % output_interval == 0) {
 
-        } 
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "-%08zu.raw", iterations);
 
+            write_fields(output_prefix + suffix);
 
+        }
 
 
+        /* Either AA phase keeps every population in the block; the halos are refilled on restart */
+        if(checkpoint_interval > 0 && iterations % checkpoint_interval == 0)
+            checkpoint_start(iterations);
 
+        checkpoint_progress(ticks);
 
-        for(auto x = 1; x < LOCAL_WIDTH - 1; x++) {
-            for(auto y = 1; y < LOCAL_HEIGHT - 1; y++) {
+#endif
 
-                units[XY(x, y, LOCAL_WIDTH)].curl = (units[XY(x + 1, y, LOCAL_WIDTH)].u.y() - units[XY(x - 1, y, LOCAL_WIDTH)].u.y()) 
-                                                  - (units[XY(x, y + 1, LOCAL_WIDTH)].u.x() - units[XY(x, y - 1, LOCAL_WIDTH)].u.x());
 
-            }
-        }
+        if(gathering)
+            gather_start();
+        else
+            gather_progress();
 
-        for(auto y = 1; y < LOCAL_HEIGHT - 1; y++) {
+        gathering = false;
 
-            units[XY(0, y, LOCAL_WIDTH)].curl = (units[XY(1, y, LOCAL_WIDTH)].u.y()     - units[XY(0, y, LOCAL_WIDTH)].u.y())
-                                              - (units[XY(0, y - 1, LOCAL_WIDTH)].u.x() - units[XY(0, y + 1, LOCAL_WIDTH)].u.x());
 
+        if(BALANCE_INTERVAL > 0 && !paused && ticks % BALANCE_INTERVAL == 0)
+            balance();
 
-            units[XY(LOCAL_WIDTH - 1, y, LOCAL_WIDTH)].curl = (units[XY(LOCAL_WIDTH - 1, y, LOCAL_WIDTH)].u.y()     - units[XY(LOCAL_WIDTH - 2, y, LOCAL_WIDTH)].u.y())
-                                                            - (units[XY(LOCAL_WIDTH - 1, y - 1, LOCAL_WIDTH)].u.x() - units[XY(LOCAL_WIDTH - 1, y + 1, LOCAL_WIDTH)].u.x());
+    } while(running);
 
-        }
 
 
+#if !defined(HEADLESS)
 
+    rendering = false;
 
+    if(renderer.joinable())
+        renderer.join();
 
+#endif
 
-        for(auto x = 1; x < LOCAL_WIDTH - 1; x++) {
-            for(auto y = 1; y < LOCAL_HEIGHT - 1; y++) {
 
-                if(units[XY(x, y, LOCAL_WIDTH)].barrier) {
+    gather_wait();
 
 
-                        units[XY(x, y - 1, LOCAL_WIDTH)].nS += units[XY(x, y, LOCAL_WIDTH)].nN;
-                                                               units[XY(x, y, LOCAL_WIDTH)].nN = 0;
+#if defined(HEADLESS)
 
+    checkpoint_finish();
 
-                        units[XY(x, y + 1, LOCAL_WIDTH)].nN += units[XY(x, y, LOCAL_WIDTH)].nS;
-                                                               units[XY(x, y, LOCAL_WIDTH)].nS = 0;
+#endif
 
+#if defined(BENCH)
 
-                        units[XY(x - 1, y, LOCAL_WIDTH)].nW += units[XY(x, y, LOCAL_WIDTH)].nE;
-                                                               units[XY(x, y, LOCAL_WIDTH)].nE = 0;
+    gather_fields();
 
+#endif
 
-                        units[XY(x + 1, y, LOCAL_WIDTH)].nE += units[XY(x, y, LOCAL_WIDTH)].nW;
-                                                               units[XY(x, y, LOCAL_WIDTH)].nW = 0;
+    MPI_Wait(&control_request, MPI_STATUS_IGNORE);
 
 
+#if defined(HEADLESS)
 
-                        units[XY(x + 1, y - 1, LOCAL_WIDTH)].nSE += units[XY(x, y, LOCAL_WIDTH)].nNW;
-                                                                    units[XY(x, y, LOCAL_WIDTH)].nNW = 0;
+    double bench_end = MPI_Wtime();
 
+    if(world_rank == PRIMARY) {
 
-                        units[XY(x - 1, y - 1, LOCAL_WIDTH)].nSW += units[XY(x, y, LOCAL_WIDTH)].nNE;
-                                                                    units[XY(x, y, LOCAL_WIDTH)].nNE = 0;
+#if defined(BENCH)
 
+        std::cerr << std::fixed << (bench_end - bench_start) << std::endl; 
 
-                        units[XY(x + 1, y + 1, LOCAL_WIDTH)].nNE += units[XY(x, y, LOCAL_WIDTH)].nSW;
-                                                                    units[XY(x, y, LOCAL_WIDTH)].nSW = 0;
+#else
 
+        const double seconds = bench_end - bench_start;
+        const size_t stepped = iterations - restart.iterations;
 
-                        units[XY(x - 1, y + 1, LOCAL_WIDTH)].nNW += units[XY(x, y, LOCAL_WIDTH)].nSE;
-                                                                    units[XY(x, y, LOCAL_WIDTH)].nSE = 0;
+        std::cout << stepped << " steps of " << viewport_width << "x" << viewport_height << " cells in " << seconds << " s, "
+                  << (viewport_width * viewport_height * stepped / seconds / 1e6) << " MLUPS" << std::endl;
 
-        
+#endif
 
-                }
+    }
 
-            }
-        }
+#endif
 
 
+#if defined(BENCH_DUMP)
 
+    if(world_rank == PRIMARY) {
 
+        std::ofstream dump(BENCH_DUMP_FILE, std::ios::binary);
 
-        
-        MPI_Gather(units, unit_size, MPI_TYPE_UNIT, frame, unit_size, MPI_TYPE_UNIT, PRIMARY, MPI_COMM_WORLD);
+        for(const auto* field : { frame.ux, frame.uy, frame.rho, frame.curl }) {
 
+            for(size_t k = 0; k < frame.size; k++) {
 
-#if !defined(BENCH)
-        usleep(1000);
-#endif
+                const double value = field[k];
+                dump.write((const char*) &value, sizeof(value));
 
-    } while(running);
+            }
 
+        }
 
+        if(!dump)
+            MPI_Abort(MPI_COMM_WORLD, __LINE__);
 
-#if defined(BENCH)
+    }
 
-    double bench_end = MPI_Wtime();
+#endif
 
-    if(world_rank == PRIMARY)
-        std::cerr << std::fixed << (bench_end - bench_start) << std::endl; 
 
-#endif
+    pool_stop();
 
+    halo_release();
 
     return MPI_Finalize();
 